@@ -5,6 +5,7 @@
 #include <stdexcept>
 #include <string.h>
 #include <vector>
+#include <stdint.h>
 
 #ifndef __arm__
     #define BUFFER_ALLOW_UNALIGNED_MEMORY_ACCESS 1
@@ -151,16 +152,262 @@ public:
     }
 };
 
+/** @brief Thread-local, size-classed free lists of memory blocks.
+ * Blocks of up to kMaxPooledSize bytes are rounded up to one of kClassCount size
+ * classes (16-byte steps up to 128 bytes, then four classes per power of two), and
+ * released blocks are kept in a per-thread list of their class instead of being
+ * returned to the system, so that short-lived buffers - commands, received
+ * messages, decrypted payloads - are recycled without locking.
+ * All blocks come from malloc(), so a block can be freed on a thread other than the
+ * one that allocated it (it just ends up in that thread's lists), or with ::free().
+ * A block is pooled on release only if its size is exactly a class size.
+ */
+class BufferPool
+{
+public:
+    enum { kMaxPooledSize = 4096, kClassCount = 28 };
+    /** Each class caches at most this many bytes per thread, the rest is freed */
+    enum { kMaxCachedBytes = 32 * 1024 };
+    struct Stats
+    {
+        uint64_t allocs;     //blocks requested from the pool
+        uint64_t heapAllocs; //requests that had to go to malloc()/realloc()
+    };
+protected:
+    struct FreeBlock { FreeBlock* next; };
+    //Trivially destructible, so that it remains usable until the thread exits,
+    //i.e. by buffers destroyed after the Drainer below
+    struct Lists
+    {
+        FreeBlock* free[kClassCount];
+        unsigned count[kClassCount];
+        Stats stats;
+        bool closed;
+    };
+    struct Drainer
+    {
+        Lists& lists;
+        Drainer(Lists& aLists): lists(aLists) {}
+        ~Drainer()
+        {
+            lists.closed = true;
+            for (unsigned cls = 0; cls < kClassCount; cls++)
+            {
+                auto blk = lists.free[cls];
+                while (blk)
+                {
+                    auto next = blk->next;
+                    ::free(blk);
+                    blk = next;
+                }
+                lists.free[cls] = nullptr;
+                lists.count[cls] = 0;
+            }
+        }
+    };
+    static Lists& lists()
+    {
+        static thread_local Lists sLists; //zero-initialized
+        static thread_local Drainer sDrainer(sLists);
+        return sLists;
+    }
+public:
+    /** @brief The index of the smallest class that fits \c size bytes.
+     * \c size must be in [1, kMaxPooledSize] */
+    static unsigned classOf(size_t size)
+    {
+        assert(size && size <= kMaxPooledSize);
+        if (size <= 128)
+            return (unsigned)((size + 15) >> 4) - 1;
+        unsigned k = 7; //size-1 is in [2^k, 2^(k+1))
+        while (((size - 1) >> (k + 1)) != 0)
+            k++;
+        return 8 + (k - 7) * 4 + (unsigned)((size - 1 - ((size_t)1 << k)) >> (k - 2));
+    }
+    static size_t classSize(unsigned cls)
+    {
+        assert(cls < kClassCount);
+        if (cls < 8)
+            return (cls + 1) * 16;
+        unsigned k = 7 + (cls - 8) / 4;
+        return ((size_t)1 << k) + ((size_t)((cls - 8) % 4 + 1) << (k - 2));
+    }
+    /** @brief Allocation counters of the calling thread */
+    static const Stats& stats() { return lists().stats; }
+    /** @brief Allocates a block of at least \c size bytes, and sets \c size to the
+     * actual (class) size of the block. Returns \c nullptr if out of memory */
+    static char* alloc(size_t& size)
+    {
+        auto& l = lists();
+        l.stats.allocs++;
+        if (size && size <= kMaxPooledSize)
+        {
+            auto cls = classOf(size);
+            size = classSize(cls);
+            auto blk = l.free[cls];
+            if (blk)
+            {
+                l.free[cls] = blk->next;
+                l.count[cls]--;
+                return reinterpret_cast<char*>(blk);
+            }
+        }
+        l.stats.heapAllocs++;
+        return (char*)::malloc(size);
+    }
+    /** @brief Grows a block. The contents up to \c oldSize are preserved.
+     * On failure, returns \c nullptr and the original block is left intact */
+    static char* realloc(char* ptr, size_t oldSize, size_t& newSize)
+    {
+        if (newSize > kMaxPooledSize)
+        {
+            auto& l = lists();
+            l.stats.allocs++;
+            l.stats.heapAllocs++;
+            return (char*)::realloc(ptr, newSize);
+        }
+        auto blk = alloc(newSize);
+        if (!blk)
+            return nullptr;
+        memcpy(blk, ptr, (oldSize < newSize) ? oldSize : newSize);
+        free(ptr, oldSize);
+        return blk;
+    }
+    static void free(char* ptr, size_t size)
+    {
+        auto& l = lists();
+        if (size && size <= kMaxPooledSize && !l.closed)
+        {
+            auto cls = classOf(size);
+            if (classSize(cls) == size && l.count[cls] < kMaxCachedBytes / size)
+            {
+                auto blk = reinterpret_cast<FreeBlock*>(ptr);
+                blk->next = l.free[cls];
+                l.free[cls] = blk;
+                l.count[cls]++;
+                return;
+            }
+        }
+        ::free(ptr);
+    }
+};
+
+/** @brief The memory allocation strategy of Buffer.
+ * The sizes are in/out parameters - a strategy may round the requested size up, and
+ * the buffer then uses the whole block.
+ * Every strategy must hand out malloc()-compatible blocks, and must accept blocks of
+ * the other strategies, as buffers allocated before the strategy is changed are
+ * released via the new one.
+ */
+struct BufferAllocator
+{
+    char* (*alloc)(size_t& size);
+    char* (*realloc)(char* ptr, size_t oldSize, size_t& newSize);
+    void (*free)(char* ptr, size_t size);
+
+    static char* mallocAlloc(size_t& size) { return (char*)::malloc(size); }
+    static char* mallocRealloc(char* ptr, size_t, size_t& newSize) { return (char*)::realloc(ptr, newSize); }
+    static void mallocFree(char* ptr, size_t) { ::free(ptr); }
+    /** @brief Plain malloc/realloc/free */
+    static BufferAllocator heap() { return BufferAllocator{mallocAlloc, mallocRealloc, mallocFree}; }
+    /** @brief Thread-local size-classed free lists, see BufferPool */
+    static BufferAllocator pooled() { return BufferAllocator{BufferPool::alloc, BufferPool::realloc, BufferPool::free}; }
+    /** @brief The strategy used by all buffers. Pooled, unless BUFFER_NO_POOL is defined
+     * (i.e. for memory debugging tools). Should be changed only at startup,
+     * before buffers are used by more than one thread */
+    static BufferAllocator& current()
+    {
+#ifndef BUFFER_NO_POOL
+        static BufferAllocator sCurrent = pooled();
+#else
+        static BufferAllocator sCurrent = heap();
+#endif
+        return sCurrent;
+    }
+};
+
 class Buffer: public StaticBuffer
 {
 protected:
     size_t mBufSize;
+    bool mIsInline; //mBuf is storage embedded in the (derived) object, which we must not free
     enum {kMinBufSize = 64};
     void zero()
     {
         mBuf = nullptr;
         mBufSize = 0;
         mDataSize = 0;
+        mIsInline = false;
+    }
+    /** Allocates a new block of at least \c size bytes. Any previous block must
+     * have been released, its contents are not preserved */
+    void allocBuf(size_t size, const char* caller)
+    {
+        auto newsize = size;
+        auto blk = BufferAllocator::current().alloc(newsize);
+        if (!blk)
+        {
+            zero();
+            throw std::runtime_error(std::string(caller)+": Out of memory allocating block of size "+std::to_string(size));
+        }
+        mBuf = blk;
+        mBufSize = newsize;
+        mIsInline = false;
+    }
+    /** Grows the block to at least \c size bytes, preserving the data */
+    void reallocBuf(size_t size, const char* caller)
+    {
+        auto newsize = size;
+        char* blk;
+        if (mIsInline)
+        {
+            blk = BufferAllocator::current().alloc(newsize);
+            if (blk)
+                memcpy(blk, mBuf, mDataSize);
+        }
+        else
+        {
+            blk = BufferAllocator::current().realloc(mBuf, mBufSize, newsize);
+        }
+        if (!blk)
+            throw std::runtime_error(std::string(caller)+": Out of memory reallocating block of size "+std::to_string(size));
+        mBuf = blk;
+        mBufSize = newsize;
+        mIsInline = false;
+    }
+    /** Grows the buffer for a write that ends at \c reqdSize. The capacity grows
+     * by at least half, so that a sequence of appends does amortised O(1) copying */
+    void growFor(size_t reqdSize, const char* caller)
+    {
+        auto newsize = mBufSize + (mBufSize >> 1);
+        if (newsize < reqdSize)
+            newsize = reqdSize;
+        if (!mBuf)
+            allocBuf(newsize, caller);
+        else
+            reallocBuf(newsize, caller);
+    }
+    void freeBuf()
+    {
+        if (mBuf && !mIsInline)
+            BufferAllocator::current().free(mBuf, mBufSize);
+    }
+    /** For classes that embed a small buffer in the object itself. Data up to
+     * \c inlineSize bytes is kept there and never touches the heap. If \c size is
+     * bigger, or when the data outgrows it, the buffer moves to a heap block */
+    Buffer(size_t size, char* inlineBuf, size_t inlineSize)
+    {
+        mDataSize = 0;
+        if (size <= inlineSize)
+        {
+            mBuf = inlineBuf;
+            mBufSize = inlineSize;
+            mIsInline = true;
+        }
+        else
+        {
+            allocBuf(size, "Buffer");
+        }
     }
 public:
     char* buf() { return mBuf;}
@@ -171,13 +418,7 @@ public:
         if (size)
         {
             mDataSize = 0;
-            mBuf = (char*)malloc(size);
-            if (!mBuf)
-            {
-                mBufSize = 0;
-                throw std::runtime_error("Out of memory allocating block of size "+ std::to_string(size));
-            }
-            mBufSize = size;
+            allocBuf(size, "Buffer");
         }
         else
         {
@@ -188,8 +429,7 @@ public:
     {
         if (data && datalen)
         {
-            mBuf = (char*)malloc(datalen);
-            mBufSize = datalen;
+            allocBuf(datalen, "Buffer");
             memcpy(mBuf, data, datalen);
             mDataSize = datalen;
         }
@@ -199,15 +439,27 @@ public:
         }
     }
     Buffer(Buffer&& other)
-        :StaticBuffer(other.mBuf, other.mDataSize), mBufSize(other.mBufSize) { other.zero(); }
+        :StaticBuffer(other.mBuf, other.mDataSize), mBufSize(other.mBufSize), mIsInline(false)
+    {
+        if (other.mIsInline) //can't take the other object's storage
+        {
+            allocBuf(other.mBufSize, "Buffer");
+            memcpy(mBuf, other.mBuf, mDataSize);
+        }
+        other.zero();
+    }
 
     template <bool withNull>
     Buffer(const std::string& src)
     {
-        mBufSize = withNull ? src.size()+1 : src.size();
-        mBuf = (char*)malloc(mBufSize);
-        memcpy(mBuf, src.c_str(), mBufSize);
-        mDataSize = mBufSize;
+        mDataSize = withNull ? src.size()+1 : src.size();
+        if (!mDataSize)
+        {
+            zero();
+            return;
+        }
+        allocBuf(mDataSize, "Buffer");
+        memcpy(mBuf, src.c_str(), mDataSize);
     }
     void assign(const void* data, size_t datalen)
     {
@@ -219,44 +471,34 @@ public:
                 mDataSize = datalen;
                 return;
             }
-            ::free(mBuf);
-        }
-        mBufSize = (kMinBufSize>datalen) ? kMinBufSize : datalen;
-        mBuf = (char*)malloc(mBufSize);
-        if (!mBuf)
-        {
-            zero();
-            throw std::runtime_error("Buffer::assign: Out of memory allocating block of size "+ std::to_string(datalen));
+            freeBuf();
         }
+        allocBuf((kMinBufSize>datalen) ? kMinBufSize : datalen, "Buffer::assign");
         mDataSize = datalen;
         ::memcpy(mBuf, data, datalen);
     }
     template <bool withNull>
     void assign(const std::string& src) { assign(src.c_str(), withNull?(src.size()+1):src.size()); }
     void copyFrom(const StaticBuffer& src) { assign(src.buf(), src.dataSize()); }
-    void reserve(size_t size)
+    /** @brief Makes sure that the buffer can hold \c capacity bytes in total.
+     * Unlike the growth on write/append, allocates only as much as requested, so
+     * this is the way to pre-size a buffer whose final size is known or estimated */
+    void reserveExact(size_t capacity)
     {
         if (!mBuf)
         {
-            mBuf = (char*)::malloc(size);
-            mBufSize = size;
             assert(mDataSize == 0);
+            allocBuf(capacity, "Buffer::reserve");
         }
-        else
+        else if (capacity > mBufSize)
         {
-            size_t newsize = mDataSize+size;
-            if (newsize <= mBufSize)
-                return;
-            char* save = mBuf;
-            mBuf = (char*)::realloc(mBuf, newsize);
-            if (!mBuf)
-            {
-                mBuf = save;
-                throw std::runtime_error("Buffer::reserve: Out of memory");
-            }
-            mBufSize = newsize;
+            reallocBuf(capacity, "Buffer::reserve");
         }
     }
+    /** @brief Makes sure that \c len more bytes can be appended without reallocation */
+    void reserveAppend(size_t len) { reserveExact(mDataSize+len); }
+    /** @brief Same as reserveAppend() */
+    void reserve(size_t size) { reserveAppend(size); }
     void setDataSize(size_t size)
     {
         if (size > mBufSize)
@@ -268,7 +510,7 @@ public:
         auto reqdSize = offset+dataLen;
         if (reqdSize > mBufSize)
         {
-            reserve(reqdSize);
+            growFor(reqdSize, "Buffer::writePtr");
             mDataSize = reqdSize;
         }
         else if (reqdSize > mDataSize)
@@ -280,8 +522,23 @@ public:
     char* appendPtr(size_t dataLen) { return writePtr(mDataSize, dataLen); }
     void takeFrom(Buffer&& other)
     {
-        if (mBuf)
-            ::free(mBuf);
+        if (other.mIsInline) //can't take the other object's storage
+        {
+            assign(other.mBuf, other.mDataSize);
+            other.zero();
+            return;
+        }
+        if (mIsInline && (other.mDataSize <= mBufSize))
+        {
+            //keep our own storage, i.e. a payload stored together with its message
+            if (other.mDataSize)
+                memcpy(mBuf, other.mBuf, other.mDataSize);
+            mDataSize = other.mDataSize;
+            other.free();
+            return;
+        }
+        freeBuf();
+        mIsInline = false;
         mBuf = other.mBuf;
         mBufSize = other.mBufSize;
         mDataSize = other.mDataSize;
@@ -304,16 +561,7 @@ public:
         else
         {
             if (reqdSize > mBufSize)
-            {
-                auto save = mBuf;
-                mBuf = (char*)::realloc(mBuf, reqdSize);
-                if (!mBuf)
-                {
-                    mBuf = save;
-                    throw std::runtime_error("Buffer::write: error reallocating block of size "+std::to_string(reqdSize));
-                }
-                mBufSize = reqdSize;
-            }
+                growFor(reqdSize, "Buffer::write");
             memcpy(mBuf+offset, data, datalen);
             mDataSize = reqdSize;
         }
@@ -344,15 +592,10 @@ public:
     {
         if (!mBuf)
             return;
-        ::free(mBuf);
-        mBuf = nullptr;
-        mBufSize = mDataSize = 0;
+        freeBuf();
+        zero();
     }
 
-    ~Buffer()
-    {
-        if (mBuf)
-            ::free(mBuf);
-    }
+    ~Buffer() { freeBuf(); }
 };
 #endif
@@ -139,28 +139,45 @@ bool Client::openDb(const std::string& sid)
         KR_LOG_WARNING("Error opening database");
         return false;
     }
-    SqliteStmt stmt(db, "select value from vars where name = 'schema_version'");
-    if (!stmt.step())
+    std::string dbVer;
+    bool hasVer;
+    {
+        //the statement must be released before we can close the db
+        SqliteStmt stmt(db, "select value from vars where name = 'schema_version'");
+        if ((hasVer = stmt.step()))
+            dbVer = stmt.stringCol(0);
+    }
+    if (!hasVer)
     {
-        sqlite3_close(db);
+        sqliteCloseDb(db);
         db = nullptr;
         KR_LOG_WARNING("Can't get local database version");
         return false;
     }
     std::string ver(gDbSchemaHash);
     ver.append("_").append(gDbSchemaVersionSuffix);
-    if (stmt.stringCol(0) != ver)
+    if (dbVer != ver)
     {
-        sqlite3_close(db);
+        sqliteCloseDb(db);
         db = nullptr;
         KR_LOG_WARNING("Database schema version is not compatible with app version, will rebuild it");
         return false;
     }
     mSid = sid;
     sqliteSimpleQuery(db, "BEGIN TRANSACTION");
+    migrateDb();
     return true;
 }
 
+void Client::migrateDb()
+{
+    auto oldVer = sqliteApplyMigrations(db, gDbMigrations, gDbMigrationCount);
+    if (oldVer >= gDbMigrationCount)
+        return;
+    commit();
+    KR_LOG_DEBUG("Migrated database schema from version %zu to %zu", oldVer, gDbMigrationCount);
+}
+
 void Client::createDbSchema()
 {
     mMyHandle = Id::null();
@@ -179,6 +196,7 @@ void Client::createDbSchema()
     ver.append("_").append(gDbSchemaVersionSuffix);
     sqliteQuery(db, "insert into vars(name, value) values('schema_version', ?)", ver);
     commit();
+    migrateDb();
 }
 
 void Client::heartbeat()
@@ -342,16 +360,14 @@ void Client::commit(const std::string& scsn)
     }
 
     sqliteQuery(db, "insert or replace into vars(name,value) values('scsn',?)", scsn);
-    sqliteSimpleQuery(db, "COMMIT TRANSACTION");
-    sqliteSimpleQuery(db, "BEGIN TRANSACTION");
+    SqliteGroupCommit::get(db).commit();
     mLastScsn = scsn;
     KR_LOG_DEBUG("Commit with scsn %s", scsn.c_str());
 }
 
 void Client::commit()
 {
-    sqliteSimpleQuery(db, "COMMIT TRANSACTION");
-    sqliteSimpleQuery(db, "BEGIN TRANSACTION");
+    SqliteGroupCommit::get(db).commit();
 }
 
 void Client::onEvent(::mega::MegaApi* api, ::mega::MegaEvent* event)
@@ -519,7 +535,7 @@ void Client::wipeDb(const std::string& sid)
     assert(!sid.empty());
     if (db)
     {
-        sqlite3_close(db);
+        sqliteCloseDb(db);
         db = nullptr;
     }
     std::string path = dbPath(sid);
@@ -914,6 +930,9 @@ promise::Promise<void> Client::terminate(bool deleteDb)
         {
             KR_LOG_INFO("Doing final COMMIT to database");
             commit();
+            auto& stmtCache = SqliteStmtCache::get(db);
+            KR_LOG_DEBUG("Sql statement cache: %zu statements, %llu hits, %llu misses",
+                stmtCache.size(), (unsigned long long)stmtCache.hitCount(), (unsigned long long)stmtCache.missCount());
         }
         if (deleteDb && !mSid.empty())
         {
@@ -921,7 +940,7 @@ promise::Promise<void> Client::terminate(bool deleteDb)
         }
         else if (db)
         {
-            sqlite3_close(db);
+            sqliteCloseDb(db);
             db = nullptr;
         }
         setInitState(kInitTerminated);
@@ -786,6 +786,7 @@ protected:
     void createDb();
     void wipeDb(const std::string& sid);
     void createDbSchema();
+    void migrateDb();
     void connectToChatd();
     karere::Id getMyHandleFromDb();
     karere::Id getMyHandleFromSdk();
@@ -253,6 +253,7 @@ void Connection::onSocketClose(int errcode, int errtype, const std::string& reas
 #endif
     }
     disableInactivityTimer();
+    mSendBuf.free(); //the commands are re-sent after reconnect
     for (auto& chatid: mChatIds)
     {
         auto& chat = mClient.chats(chatid);
@@ -382,6 +383,7 @@ promise::Promise<void> Connection::disconnect(int timeoutMs) //should be gracefu
         if (!mDisconnectPromise.done())
             mDisconnectPromise.resolve();
     }, timeoutMs);
+    flushSendBuf(); //don't lose the commands of the current batch
     ws_close(mWebSocket);
     return mDisconnectPromise;
 }
@@ -398,6 +400,7 @@ promise::Promise<void> Client::disconnect()
 
 void Connection::reset() //immediate disconnect
 {
+    mSendBuf.free();
     if (!mWebSocket)
         return;
 
@@ -410,12 +413,76 @@ bool Connection::sendBuf(Buffer&& buf)
 {
     if (!isOnline())
         return false;
+    if (!mSendBuf.empty() && (mSendBuf.dataSize()+buf.dataSize() > kMaxSendBatchBytes))
+    {
+        if (!flushSendBuf())
+            return false;
+    }
+    if (mSendBuf.empty() && (mSendBuf.bufSize() < buf.dataSize()))
+    {
+        mSendBuf.takeFrom(std::move(buf)); //no copy for a single command
+    }
+    else
+    {
+        mSendBuf.append(buf);
+        buf.free();
+    }
+    return onSendBufAppended();
+}
+
+bool Connection::sendBuf(const StaticBuffer& data)
+{
+    if (!isOnline())
+        return false;
+    if (!mSendBuf.empty() && (mSendBuf.dataSize()+data.dataSize() > kMaxSendBatchBytes))
+    {
+        if (!flushSendBuf())
+            return false;
+    }
+    mSendBuf.append(data);
+    return onSendBufAppended();
+}
+
+bool Connection::onSendBufAppended()
+{
+    if (mSendBuf.dataSize() >= kMaxSendBatchBytes)
+        return flushSendBuf();
+
+    if (!mSendFlushScheduled)
+    {
+        mSendFlushScheduled = true;
+        auto wptr = weakHandle();
+        marshallCall([wptr, this]()
+        {
+            if (wptr.deleted())
+                return;
+            mSendFlushScheduled = false;
+            flushSendBuf();
+        });
+    }
+    return true;
+}
+
+bool Connection::flushSendBuf()
+{
+    if (mSendBuf.empty())
+        return true;
+    if (!isOnline())
+    {
+        mSendBuf.free();
+        return false;
+    }
 //WARNING: ws_send_msg_ex() is destructive to the buffer - it applies the websocket mask directly
-//Copy the data to preserve the original
-    auto rc = ws_send_msg_ex(mWebSocket, buf.buf(), buf.dataSize(), 1);
-    buf.free(); //just in case, as it's content is xor-ed with the websock datamask so it's unusable
-    bool result = (!rc && isOnline());
-    return result;
+    auto rc = ws_send_msg_ex(mWebSocket, mSendBuf.buf(), mSendBuf.dataSize(), 1);
+    //the content is xor-ed with the websock datamask, so it's unusable. Keep the
+    //memory for the next batch, unless it was an oversized command
+    if (mSendBuf.bufSize() > kMaxSendBatchBytes)
+        mSendBuf.free();
+    else
+        mSendBuf.clear();
+    if (rc)
+        CHATD_LOG_WARNING("Error sending a batch of commands to shard %d", mShardNo);
+    return (!rc && isOnline());
 }
 bool Chat::sendCommand(Command&& cmd)
 {
@@ -429,10 +496,9 @@ bool Chat::sendCommand(Command&& cmd)
 
 bool Chat::sendCommand(const Command& cmd)
 {
-    Buffer buf(cmd.buf(), cmd.dataSize());
     if (krLoggerWouldLog(krLogChannel_chatd, krLogLevelDebug))
         logSend(cmd);
-    auto result = mConnection.sendBuf(std::move(buf));
+    auto result = mConnection.sendBuf(static_cast<const StaticBuffer&>(cmd));
     if (!result)
         CHATD_LOG_DEBUG("  Can't send, we are offline");
     return result;
@@ -523,6 +589,8 @@ void Chat::onJoinRejected()
 
 void Chat::onDisconnect()
 {
+    //we will not get a HISTDONE for the OLDMSGs received so far
+    decryptOldMsgBatch();
     if (mServerOldHistCbEnabled && (mServerFetchState & kHistFetchingOldFromServer))
     {
         //app has been receiving old history from server, but we are now
@@ -536,6 +604,7 @@ void Chat::onDisconnect()
 
 HistSource Chat::getHistory(unsigned count)
 {
+    mLastHistUse = ++mClient.mHistUseCounter;
     if (isNotifyingOldHistFromServer())
     {
         return kHistSourceServer;
@@ -637,8 +706,8 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
     const karere::SetOfIds& initialUsers, uint32_t chatCreationTs,
     ICrypto* crypto)
     : mConnection(conn), mClient(conn.mClient), mChatId(chatid),
-      mListener(listener), mUsers(initialUsers), mCrypto(crypto),
-      mLastMsgTs(chatCreationTs)
+      mListener(listener), mUsers(initialUsers),
+      mCrypto(crypto), mLastMsgTs(chatCreationTs)
 {
     assert(mChatId);
     assert(mListener);
@@ -656,6 +725,12 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
     mLastReceivedId = info.lastRecvId;
     mLastSeenIdx = mDbInterface->getIdxOfMsgid(mLastSeenId);
     mLastReceivedIdx = mDbInterface->getIdxOfMsgid(mLastReceivedId);
+    if (!mDbInterface->getUnreadCount(mUnreadCount))
+    {
+        //not yet stored, i.e. the db schema has just been upgraded
+        mUnreadCount = mDbInterface->getPeerMsgCountAfterIdx(mLastSeenIdx);
+        mDbInterface->setUnreadCount(mUnreadCount);
+    }
 
     if ((mHaveAllHistory = mDbInterface->haveAllHistory()))
     {
@@ -700,9 +775,12 @@ Idx Chat::getHistoryFromDb(unsigned count)
     assert(mHasMoreHistoryInDb); //we are within the db range
     std::vector<Message*> messages;
     CALL_DB(fetchDbHistory, lownum()-1, count, messages);
-    for (auto msg: messages)
     {
-        msgIncoming(false, msg, true); //increments mLastHistFetch/DecryptCount, may reset mHasMoreHistoryInDb if this msgid == mLastKnownMsgid
+        HistBatchGuard batch(*this);
+        for (auto msg: messages)
+        {
+            msgIncoming(false, msg, true); //increments mLastHistFetch/DecryptCount, may reset mHasMoreHistoryInDb if this msgid == mLastKnownMsgid
+        }
     }
     if (mNextHistFetchIdx == CHATD_IDX_INVALID)
     {
@@ -722,37 +800,87 @@ Idx Chat::getHistoryFromDb(unsigned count)
     return (Idx)messages.size();
 }
 
-#define READ_ID(varname, offset)\
-    assert(offset==pos-base); Id varname(buf.read<uint64_t>(pos)); pos+=sizeof(uint64_t)
-#define READ_CHATID(offset)\
-    assert(offset==pos-base); chatid = buf.read<uint64_t>(pos); pos+=sizeof(uint64_t)
+/** @brief Wire layout of inbound commands, used by the frame decoder to validate
+ * a whole command with a single bounds check before dispatching it.
+ * \c hdrLen is the size of the fixed part following the opcode byte, or -1 if
+ * we don't expect to receive that opcode. If \c payloadLenOfs is not negative,
+ * it is the offset, within the fixed part, of a 32-bit length of a variable-size
+ * payload that immediately follows the fixed part.
+ */
+struct InCmdLayout
+{
+    int8_t hdrLen;
+    int8_t payloadLenOfs;
+};
 
-#define READ_32(varname, offset)\
-    assert(offset==pos-base); uint32_t varname(buf.read<uint32_t>(pos)); pos+=4
-#define READ_16(varname, offset)\
-    assert(offset==pos-base); uint16_t varname(buf.read<uint16_t>(pos)); pos+=2
-#define READ_8(varname, offset)\
-    assert(offset==pos-base); uint8_t varname(buf.read<uint8_t>(pos)); pos+=1
+static const InCmdLayout gInCmdLayouts[] =
+{
+    { 0, -1}, //KEEPALIVE
+    {17, -1}, //JOIN: <chatid.8> <userid.8> <priv.1>
+    {MsgCommandView::kHeaderSize, 34}, //OLDMSG: see MsgCommandView
+    {MsgCommandView::kHeaderSize, 34}, //NEWMSG
+    {MsgCommandView::kHeaderSize, 34}, //MSGUPD
+    {16, -1}, //SEEN: <chatid.8> <msgid.8>
+    {16, -1}, //RECEIVED: <chatid.8> <msgid.8>
+    {20, -1}, //RETENTION: <chatid.8> <userid.8> <period.4>
+    {-1, -1}, //HIST
+    {-1, -1}, //RANGE
+    {16, -1}, //NEWMSGID: <msgxid.8> <msgid.8>
+    {18, -1}, //REJECT: <chatid.8> <id.8> <op.1> <reason.1>
+    {17, -1}, //BROADCAST: <chatid.8> <userid.8> <type.1>
+    { 8, -1}, //HISTDONE: <chatid.8>
+    {-1, -1}, //(invalid)
+    {-1, -1}, //(invalid)
+    {-1, -1}, //(invalid)
+    {16, 12}, //NEWKEY: <chatid.8> <keyid.4> <totalLen.4> <keys>
+    {16, -1}, //KEYID: <chatid.8> <keyxid.4> <keyid.4>
+    {-1, -1}, //JOINRANGEHIST
+    {-1, -1}, //MSGUPDX
+    {16, -1}  //MSGID: <msgxid.8> <msgid.8>
+};
+static_assert(sizeof(gInCmdLayouts)/sizeof(gInCmdLayouts[0]) == OP_LAST+1,
+              "gInCmdLayouts must have an entry for every opcode");
 
 // inbound command processing
 // multiple commands can appear as one WebSocket frame, but commands never cross frame boundaries
 // CHECK: is this assumption correct on all browsers and under all circumstances?
 void Connection::execCommand(const StaticBuffer& buf)
 {
+    const char* data = buf.buf();
+    size_t end = buf.dataSize();
     size_t pos = 0;
-//IMPORTANT: Increment pos before calling the command handler, because the handler may throw, in which
-//case the next iteration will not advance and will execute the same command again, resulting in
-//infinite loop
-    while (pos < buf.dataSize())
+    while (pos < end)
     {
-      char opcode = buf.buf()[pos];
+      uint8_t opcode = data[pos++];
       Id chatid;
       try
       {
-        pos++;
-#ifndef NDEBUG
-        size_t base = pos;
-#endif
+        if ((opcode > OP_LAST) || (gInCmdLayouts[opcode].hdrLen < 0))
+        {
+            CHATD_LOG_ERROR("Unknown opcode %d, ignoring all subsequent commands", opcode);
+            return;
+        }
+        // Check the length of the whole command once. Fields are then read via
+        // views that point directly into the receive buffer, without further checks
+        auto& layout = gInCmdLayouts[opcode];
+        size_t avail = end - pos;
+        size_t cmdLen = layout.hdrLen;
+        if (cmdLen > avail)
+            throw BufferRangeError("Command header is "+std::to_string(cmdLen-avail)+
+                                   " bytes past buffer end");
+        if (layout.payloadLenOfs >= 0)
+        {
+            uint32_t payloadLen = Buffer::alignSafeRead<uint32_t>(data+pos+layout.payloadLenOfs);
+            if (payloadLen > avail-cmdLen)
+                throw BufferRangeError("Command payload is "+std::to_string(payloadLen-(avail-cmdLen))+
+                                       " bytes past buffer end");
+            cmdLen += payloadLen;
+        }
+        CommandView cmd(data+pos);
+//IMPORTANT: Advance pos before calling the command handler, because the handler may throw, in which
+//case the next iteration will not advance and will execute the same command again, resulting in
+//infinite loop
+        pos += cmdLen;
 //        CHATD_LOG_DEBUG("RECV %s", Command::opcodeToStr(opcode));
         switch (opcode)
         {
@@ -764,19 +892,18 @@ void Connection::execCommand(const StaticBuffer& buf)
             }
             case OP_BROADCAST:
             {
-                READ_CHATID(0);
-                READ_ID(userid, 8);
-                READ_8(bcastType, 16);
+                chatid = cmd.readId(0);
+                Id userid = cmd.readId(8);
+                uint8_t bcastType = cmd.read<uint8_t>(16);
                 auto& chat = mClient.chats(chatid);
                 chat.handleBroadcast(userid, bcastType);
                 break;
             }
             case OP_JOIN:
             {
-                READ_CHATID(0);
-                READ_ID(userid, 8);
-                Priv priv = (Priv)buf.read<int8_t>(pos);
-                pos++;
+                chatid = cmd.readId(0);
+                Id userid = cmd.readId(8);
+                Priv priv = (Priv)cmd.read<int8_t>(16);
                 CHATD_LOG_DEBUG("%s: recv JOIN - user '%s' with privilege level %d",
                                 ID_CSTR(chatid), ID_CSTR(userid), priv);
                 auto& chat =  mClient.chats(chatid);
@@ -790,38 +917,27 @@ void Connection::execCommand(const StaticBuffer& buf)
             case OP_NEWMSG:
             case OP_MSGUPD:
             {
-                READ_CHATID(0);
-                READ_ID(userid, 8);
-                READ_ID(msgid, 16);
-                READ_32(ts, 24);
-                READ_16(updated, 28);
-                READ_32(keyid, 30);
-                READ_32(msglen, 34);
-                const char* msgdata = buf.readPtr(pos, msglen);
-                pos += msglen;
+                MsgCommandView msg(cmd.ptr(0));
+                chatid = msg.chatid();
                 CHATD_LOG_DEBUG("%s: recv %s - msgid: '%s', from user '%s' with keyid %x",
-                    ID_CSTR(chatid), Command::opcodeToStr(opcode), ID_CSTR(msgid),
-                    ID_CSTR(userid), keyid);
+                    ID_CSTR(chatid), Command::opcodeToStr(opcode), ID_CSTR(msg.msgid()),
+                    ID_CSTR(msg.userid()), msg.keyid());
 
-                std::unique_ptr<Message> msg(new Message(msgid, userid, ts, updated, msgdata, msglen, false, keyid));
-                msg->setEncrypted(1);
                 Chat& chat = mClient.chats(chatid);
                 if (opcode == OP_MSGUPD)
                 {
-                    chat.onMsgUpdated(msg.release());
+                    chat.onMsgUpdated(msg.toMessage());
                 }
                 else
                 {
-                    chat.msgIncoming((opcode == OP_NEWMSG), msg.release(), false);
+                    chat.msgIncoming((opcode == OP_NEWMSG), msg);
                 }
                 break;
             }
             case OP_SEEN:
             {
-            //TODO: why do we test the whole buffer's len to determine the current command's len?
-            //buffer may contain other commands following it
-                READ_CHATID(0);
-                READ_ID(msgid, 8);
+                chatid = cmd.readId(0);
+                Id msgid = cmd.readId(8);
                 CHATD_LOG_DEBUG("%s: recv SEEN - msgid: '%s'",
                                 ID_CSTR(chatid), ID_CSTR(msgid));
                 mClient.chats(chatid).onLastSeen(msgid);
@@ -829,25 +945,25 @@ void Connection::execCommand(const StaticBuffer& buf)
             }
             case OP_RECEIVED:
             {
-                READ_CHATID(0);
-                READ_ID(msgid, 8);
+                chatid = cmd.readId(0);
+                Id msgid = cmd.readId(8);
                 CHATD_LOG_DEBUG("%s: recv RECEIVED - msgid: '%s'", ID_CSTR(chatid), ID_CSTR(msgid));
                 mClient.chats(chatid).onLastReceived(msgid);
                 break;
             }
             case OP_RETENTION:
             {
-                READ_CHATID(0);
-                READ_ID(userid, 8);
-                READ_32(period, 16);
+                chatid = cmd.readId(0);
+                Id userid = cmd.readId(8);
+                uint32_t period = cmd.read<uint32_t>(16);
                 CHATD_LOG_DEBUG("%s: recv RETENTION by user '%s' to %u second(s)",
                                 ID_CSTR(chatid), ID_CSTR(userid), period);
                 break;
             }
             case OP_MSGID:
             {
-                READ_ID(msgxid, 0);
-                READ_ID(msgid, 8);
+                Id msgxid = cmd.readId(0);
+                Id msgid = cmd.readId(8);
                 if (!msgid)
                 {
                     CHATD_LOG_ERROR("MSGID with zero message id received, ignoring");
@@ -858,30 +974,17 @@ void Connection::execCommand(const StaticBuffer& buf)
             }
             case OP_NEWMSGID:
             {
-                READ_ID(msgxid, 0);
-                READ_ID(msgid, 8);
+                Id msgxid = cmd.readId(0);
+                Id msgid = cmd.readId(8);
                 mClient.msgConfirm(msgxid, msgid);
                 break;
             }
-/*            case OP_RANGE:
-            {
-                READ_CHATID(0);
-                READ_ID(oldest, 8);
-                READ_ID(newest, 16);
-                CHATD_LOG_DEBUG("%s: recv RANGE - (%s - %s)",
-                                ID_CSTR(chatid), ID_CSTR(oldest), ID_CSTR(newest));
-                auto& msgs = mClient.chats(chatid);
-                if (msgs.onlineState() == kChatStateJoining)
-                    msgs.initialFetchHistory(newest);
-                break;
-            }
-*/
             case OP_REJECT:
             {
-                READ_CHATID(0);
-                READ_ID(id, 8);
-                READ_8(op, 16);
-                READ_8(reason, 17);
+                chatid = cmd.readId(0);
+                Id id = cmd.readId(8);
+                uint8_t op = cmd.read<uint8_t>(16);
+                uint8_t reason = cmd.read<uint8_t>(17);
                 CHATD_LOG_WARNING("%s: recv REJECT of %s: id='%s', reason: %hu",
                     ID_CSTR(chatid), Command::opcodeToStr(op), ID_CSTR(id), reason);
                 auto& chat = mClient.chats(chatid);
@@ -906,34 +1009,32 @@ void Connection::execCommand(const StaticBuffer& buf)
             }
             case OP_HISTDONE:
             {
-                READ_CHATID(0);
+                chatid = cmd.readId(0);
                 CHATD_LOG_DEBUG("%s: recv HISTDONE - history retrieval finished", ID_CSTR(chatid));
                 mClient.chats(chatid).onHistDone();
                 break;
             }
             case OP_KEYID:
             {
-                READ_CHATID(0);
-                READ_32(keyxid, 8);
-                READ_32(keyid, 12);
+                chatid = cmd.readId(0);
+                uint32_t keyxid = cmd.read<uint32_t>(8);
+                uint32_t keyid = cmd.read<uint32_t>(12);
                 CHATD_LOG_DEBUG("%s: recv KEYID %u", ID_CSTR(chatid), keyid);
                 mClient.chats(chatid).keyConfirm(keyxid, keyid);
                 break;
             }
             case OP_NEWKEY:
             {
-                READ_CHATID(0);
-                pos += 4; //skip dummy 32bit keyid
-                READ_32(totalLen, 12);
-                const char* keys = buf.readPtr(pos, totalLen);
-                pos+=totalLen;
+                chatid = cmd.readId(0);
+                //skip dummy 32bit keyid
+                uint32_t totalLen = cmd.read<uint32_t>(12);
                 CHATD_LOG_DEBUG("%s: recv NEWKEY", ID_CSTR(chatid));
-                mClient.chats(chatid).onNewKeys(StaticBuffer(keys, totalLen));
+                mClient.chats(chatid).onNewKeys(StaticBuffer(cmd.ptr(16), totalLen));
                 break;
             }
             default:
             {
-                CHATD_LOG_ERROR("Unknown opcode %d, ignoring all subsequent commands", opcode);
+                assert(false); //must have been filtered out by gInCmdLayouts
                 return;
             }
         }
@@ -966,6 +1067,7 @@ void Chat::onNewKeys(StaticBuffer&& keybuf)
 
 void Chat::onHistDone()
 {
+    decryptOldMsgBatch();
     // We may be fetching from memory and db because of a resetHistFetch()
     // while fetching from server. In that case, we don't notify about
     // fetched messages and onHistDone()
@@ -1022,6 +1124,7 @@ void Chat::onFetchHistDone()
         }
         if (mLastSeenIdx == CHATD_IDX_INVALID)
             CALL_LISTENER(onUnreadChanged);
+        trimHistory();
     }
 
     // handle last text message fetching
@@ -1102,14 +1205,39 @@ void Chat::loadManualSending()
         CALL_LISTENER(onManualSendRequired, item.msg, item.rowid, item.reason);
     }
 }
+void Chat::OutputQueue::addToIndex(iterator it)
+{
+    assert(it->msg);
+    it->mIndexedId = it->msg->id();
+    mIdIndex[it->mIndexedId].push_back(it);
+}
+
+void Chat::OutputQueue::removeFromIndex(iterator it)
+{
+    auto entry = mIdIndex.find(it->mIndexedId);
+    assert(entry != mIdIndex.end());
+    auto& items = entry->second;
+    items.erase(std::find(items.begin(), items.end(), it));
+    if (items.empty())
+        mIdIndex.erase(entry);
+}
+
+void Chat::OutputQueue::changeMsgId(iterator it, Id newId)
+{
+    removeFromIndex(it);
+    it->msg->setId(newId, false);
+    addToIndex(it);
+}
+
 Message* Chat::getMsgByXid(Id msgxid)
 {
-    for (auto& item: mSending)
+    for (auto it: mSending.itemsWithId(msgxid))
     {
+        auto& item = *it;
         if (!item.msg)
             continue;
         //id() of MSGUPD messages is a real msgid, not a msgxid
-        if ((item.msg->id() == msgxid) && (item.opcode() != OP_MSGUPD))
+        if (item.opcode() != OP_MSGUPD)
         {
             assert(item.msg->isSending());
             return item.msg;
@@ -1167,12 +1295,10 @@ void Chat::createMsgBackRefs(Message& msg)
 #endif
 
     static std::random_device rd;
-    std::vector<SendingItem*> sendingIdx;
-    sendingIdx.reserve(mSending.size());
-    for (auto& item: mSending)
-    {
-        sendingIdx.push_back(&item);
-    }
+    //the backward offsets only increase, and are at most 63, so we walk the
+    //send queue from its end just once
+    auto sendingIt = mSending.rbegin();
+    Idx sendingItPos = 0;
     Idx maxEnd = mSending.size()+size();
     if (maxEnd <= 0)
         return;
@@ -1188,9 +1314,17 @@ void Chat::createMsgBackRefs(Message& msg)
         Idx back =  (range > 1)
             ? (start + (distrib(rd) % range))
             : (start);
-        uint64_t backref = (back < (Idx)mSending.size()) //reference a not-yet confirmed message
-            ? (sendingIdx[mSending.size()-1-back]->msg->backRefId)
-            : (at(highnum()-(back-mSending.size())).backRefId);
+        uint64_t backref;
+        if (back < (Idx)mSending.size()) //reference a not-yet confirmed message
+        {
+            std::advance(sendingIt, back - sendingItPos);
+            sendingItPos = back;
+            backref = sendingIt->msg->backRefId;
+        }
+        else
+        {
+            backref = at(highnum()-(back-mSending.size())).backRefId;
+        }
         msg.backRefs.push_back(backref);
         if (end == maxEnd)
             return;
@@ -1200,7 +1334,9 @@ void Chat::createMsgBackRefs(Message& msg)
 
 Chat::SendingItem* Chat::postMsgToSending(uint8_t opcode, Message* msg)
 {
-    mSending.emplace_back(opcode, msg, mUsers);
+    if (!mRecipients)
+        mRecipients = std::make_shared<const karere::SetOfIds>(mUsers);
+    mSending.emplace_back(opcode, msg, mRecipients);
     CALL_DB(saveMsgToSending, mSending.back());
     if (mNextUnsent == mSending.end())
     {
@@ -1283,21 +1419,15 @@ Message* Chat::msgModify(Message& msg, const char* newdata, size_t newlen, void*
     }
     if (msg.isSending()) //update the not yet sent(or at least not yet confirmed) original as well, trying to avoid sending the original content
     {
-        SendingItem* item = nullptr;
-        for (auto& loopItem: mSending)
-        {
-            if (loopItem.msg->id() == msg.id())
-            {
-                item = &loopItem;
-                break;
-            }
-        }
-        assert(item);
+        auto& items = mSending.itemsWithId(msg.id());
+        assert(!items.empty());
+        auto item = items.front();
         if ((item->opcode() == OP_MSGUPD) || (item->opcode() == OP_MSGUPDX))
         {
             item->msg->updated = age + 1;
         }
         msg.assign((void*)newdata, newlen);
+        histMemoryChanged(msg);
         CALL_DB(updateMsgPlaintextInSending, item->rowid, msg);
     } //end msg.isSending()
     auto upd = new Message(msg.id(), msg.userid, msg.ts, age+1, newdata, newlen,
@@ -1374,6 +1504,7 @@ void Chat::onLastReceived(Id msgid)
 
 void Chat::onLastSeen(Id msgid)
 {
+    Idx oldSeenIdx = mLastSeenIdx;
     mLastSeenId = msgid;
     CALL_DB(setLastSeen, msgid);
     auto it = mIdToIndexMap.find(msgid);
@@ -1430,9 +1561,39 @@ void Chat::onLastSeen(Id msgid)
             }
         }
     }
+    onLastSeenIdxChanged(oldSeenIdx);
     CALL_LISTENER(onUnreadChanged);
 }
 
+void Chat::onLastSeenIdxChanged(Idx oldIdx)
+{
+    //only the messages between the old and the new last-seen change their
+    //seen status, so we count only these. The range query uses the index
+    auto newIdx = mLastSeenIdx;
+    if (newIdx == oldIdx)
+        return;
+    if ((newIdx == CHATD_IDX_INVALID) || (oldIdx == CHATD_IDX_INVALID))
+    {
+        setUnreadCount(mDbInterface->getPeerMsgCountAfterIdx(newIdx));
+    }
+    else if (newIdx > oldIdx)
+    {
+        setUnreadCount(mUnreadCount - mDbInterface->getPeerMsgCountInRange(oldIdx+1, newIdx));
+    }
+    else
+    {
+        setUnreadCount(mUnreadCount + mDbInterface->getPeerMsgCountInRange(newIdx+1, oldIdx));
+    }
+}
+
+void Chat::setUnreadCount(int count)
+{
+    if (count == mUnreadCount)
+        return;
+    mUnreadCount = count;
+    CALL_DB(setUnreadCount, count);
+}
+
 bool Chat::setMessageSeen(Idx idx)
 {
     assert(idx != CHATD_IDX_INVALID);
@@ -1448,6 +1609,7 @@ bool Chat::setMessageSeen(Idx idx)
     CHATID_LOG_DEBUG("setMessageSeen: Setting last seen msgid to %s", ID_CSTR(msg.id()));
     sendCommand(Command(OP_SEEN) + mChatId + msg.id());
 
+    Idx oldSeenIdx = mLastSeenIdx;
     Idx notifyStart;
     if (mLastSeenIdx == CHATD_IDX_INVALID)
     {
@@ -1470,6 +1632,7 @@ bool Chat::setMessageSeen(Idx idx)
             CALL_LISTENER(onMessageStatusChange, i, Message::kSeen, m);
         }
     }
+    onLastSeenIdxChanged(oldSeenIdx);
     CALL_LISTENER(onUnreadChanged);
     return true;
 }
@@ -1495,26 +1658,9 @@ int Chat::unreadMsgCount() const
             assert(size() == 1);
             return (msg->userid != client().userId()) ? 1 : 0;
         }
-        else
-        {
-            return -mDbInterface->getPeerMsgCountAfterIdx(CHATD_IDX_INVALID);
-        }
-    }
-    else if (mLastSeenIdx < lownum())
-    {
-        return mDbInterface->getPeerMsgCountAfterIdx(mLastSeenIdx);
-    }
-
-    Idx first = mLastSeenIdx+1;
-    unsigned count = 0;
-    auto last = highnum();
-    for (Idx i=first; i<=last; i++)
-    {
-        auto& msg = at(i);
-        if (msg.userid != mClient.userId())
-            count++;
+        return -mUnreadCount;
     }
-    return count;
+    return mUnreadCount;
 }
 
 void Chat::flushOutputQueue(bool fromStart)
@@ -1536,7 +1682,7 @@ void Chat::flushOutputQueue(bool fromStart)
     while (mNextUnsent != mSending.end())
     {
         ManualSendReason reason =
-             (manualResendWhenUserJoins() && !mNextUnsent->isEdit() && (mNextUnsent->recipients < mUsers))
+             (manualResendWhenUserJoins() && !mNextUnsent->isEdit() && (*mNextUnsent->recipients < mUsers))
             ? kManualSendUsersChanged : kManualSendInvalidReason;
 
         if ((reason == kManualSendInvalidReason) && (time(NULL) - mNextUnsent->msg->ts > CHATD_MAX_EDIT_AGE))
@@ -1680,15 +1826,13 @@ Idx Chat::msgConfirm(Id msgxid, Id msgid)
     auto idx = mIdToIndexMap[msgid] = highnum();
     CALL_DB(addMsgToHistory, *msg, idx);
     //update any following MSGUPDX-s referring to this msgxid
-    for (auto& item: mSending)
+    auto updxs = mSending.itemsWithId(msgxid); //copy, as changeMsgId() modifies it
+    for (auto it: updxs)
     {
-        if (item.msg->id() == msgxid)
-        {
-            assert(item.opcode() == OP_MSGUPDX);
-            CALL_DB(sendingItemMsgupdxToMsgupd, item, msgid);
-            item.msg->setId(msgid, false);
-            item.setOpcode(OP_MSGUPD);
-        }
+        assert(it->opcode() == OP_MSGUPDX);
+        CALL_DB(sendingItemMsgupdxToMsgupd, *it, msgid);
+        mSending.changeMsgId(it, msgid);
+        it->setOpcode(OP_MSGUPD);
     }
     CALL_LISTENER(onMessageConfirmed, msgxid, *msg, idx);
 
@@ -1787,21 +1931,15 @@ void Chat::onMsgUpdated(Message* cipherMsg)
 //MSGUPD from another client with out user will cancel any pending edit by our client
     if (cipherMsg->userid == client().userId())
     {
-        for (auto it = mSending.begin(); it != mSending.end(); )
+        auto items = mSending.itemsWithId(cipherMsg->id()); //copy, as erase() modifies it
+        for (auto it: items)
         {
-            auto& item = *it;
-            if (((item.opcode() != OP_MSGUPD) && (item.opcode() != OP_MSGUPDX))
-                || (item.msg->id() != cipherMsg->id()))
-            {
-                it++;
+            if ((it->opcode() != OP_MSGUPD) && (it->opcode() != OP_MSGUPDX))
                 continue;
-            }
             //erase item
-            CALL_DB(deleteItemFromSending, item.rowid);
-            auto erased = it;
-            it++;
+            CALL_DB(deleteItemFromSending, it->rowid);
             mPendingEdits.erase(cipherMsg->id());
-            mSending.erase(erased);
+            mSending.erase(it);
         }
     }
     mCrypto->msgDecrypt(cipherMsg)
@@ -1820,6 +1958,7 @@ void Chat::onMsgUpdated(Message* cipherMsg)
             auto& histmsg = at(idx);
             prevType = histmsg.type;
             histmsg.takeFrom(std::move(*msg));
+            histMemoryChanged(histmsg);
             histmsg.updated = msg->updated;
             histmsg.type = msg->type;
             histmsg.userid = msg->userid;
@@ -1918,6 +2057,8 @@ void Chat::handleTruncate(const Message& msg, Idx idx)
     {
         mHasMoreHistoryInDb = false;
     }
+    //truncation is rare, just recount what's left
+    setUnreadCount(mDbInterface->getPeerMsgCountAfterIdx(mLastSeenIdx));
     CALL_LISTENER(onUnreadChanged);
     findAndNotifyLastTextMsg();
 }
@@ -1929,9 +2070,92 @@ Id Chat::makeRandomId()
     return distrib(rd);
 }
 
+// Unloads the oldest messages from RAM, until at least \c bytes are freed, but
+// not the message at \c keepFrom and newer ones. They are reloaded from the db
+// by getHistory(), exactly as history that has never been loaded.
+// Returns the number of bytes freed
+size_t Chat::unloadOldHistory(size_t bytes, Idx keepFrom)
+{
+    //The app may reference messages it has received via getHistory(). Also, all
+    //messages to unload must be decrypted and saved to db
+    if (!bytes || empty() || (mNextHistFetchIdx != CHATD_IDX_INVALID)
+     || (mServerFetchState != kHistNotFetching)
+     || (mOldMsgBatchStart != CHATD_IDX_INVALID)
+     || (mDecryptOldHaltedAt != CHATD_IDX_INVALID)
+     || (mDecryptNewHaltedAt != CHATD_IDX_INVALID))
+    {
+        return 0;
+    }
+    Idx low = lownum();
+    Idx last = highnum(); //always keep the newest message
+    if (keepFrom < last)
+        last = keepFrom;
+    size_t freed = 0;
+    Idx end = low;
+    while ((end < last) && (freed < bytes))
+    {
+        auto& msg = at(end++);
+        freed += msg.mHistMemory;
+        mIdToIndexMap.erase(msg.id());
+        if (msg.backRefId)
+            mRefidToIdxMap.erase(msg.backRefId);
+    }
+    if (end == low)
+        return 0;
+
+    deleteMessagesBefore(end);
+    mHasMoreHistoryInDb = true;
+    CHATID_LOG_DEBUG("Unloaded %d old messages (%zu bytes) from RAM, RAM history is now %d - %d",
+        end-low, freed, lownum(), highnum());
+    return freed;
+}
+
+void Chat::trimHistory(Idx keepFrom)
+{
+    auto max = mClient.maxHistoryBytesPerChat;
+    if (max)
+    {
+        auto mem = historyMemory();
+        if (mem > max)
+            unloadOldHistory(mem - max, keepFrom);
+    }
+    mClient.enforceHistoryBudget();
+}
+
+void Client::enforceHistoryBudget()
+{
+    if (!maxHistoryBytes)
+        return;
+    //the chats keep a running count, so this is O(number of chats)
+    size_t total = 0;
+    for (auto& item: mChatForChatId)
+        total += item.second->historyMemory();
+    if (total <= maxHistoryBytes)
+        return;
+
+    std::vector<Chat*> lru;
+    for (auto& item: mChatForChatId)
+        lru.push_back(item.second.get());
+
+    std::sort(lru.begin(), lru.end(), [](const Chat* a, const Chat* b)
+    {
+        return a->mLastHistUse < b->mLastHistUse;
+    });
+    for (auto chat: lru)
+    {
+        total -= chat->unloadOldHistory(total - maxHistoryBytes);
+        if (total <= maxHistoryBytes)
+            break;
+    }
+}
+
 void Chat::deleteMessagesBefore(Idx idx)
 {
+    //pre-decrypted results of the deleted messages would never be picked up
+    CALL_CRYPTO(cancelPreDecrypt);
     //delete everything before idx, but not including idx
+    for (Idx i = lownum(), end = std::min(idx, highnum()+1); i < end; i++)
+        mHistoryBytes -= at(i).mHistMemory;
     if (idx > mForwardStart)
     {
         mBackwardList.clear();
@@ -1954,14 +2178,11 @@ Message::Status Chat::getMsgStatus(const Message& msg, Idx idx) const
             return Message::kSending;
 
         // Check if we have an unconfirmed edit
-        for (auto& item: mSending)
+        for (auto it: mSending.itemsWithId(msg.id()))
         {
-            if (item.msg->id() == msg.id())
-            {
-                auto op = item.opcode();
-                if (op == OP_MSGUPD || op == OP_MSGUPDX)
-                    return Message::kSending;
-            }
+            auto op = it->opcode();
+            if (op == OP_MSGUPD || op == OP_MSGUPDX)
+                return Message::kSending;
         }
         if (idx <= mLastReceivedIdx)
             return Message::kDelivered;
@@ -1977,6 +2198,30 @@ Message::Status Chat::getMsgStatus(const Message& msg, Idx idx) const
         return (idx <= mLastSeenIdx) ? Message::kSeen : Message::kNotSeen;
     }
 }
+Idx Chat::msgIncoming(bool isNew, const MsgCommandView& cmd)
+{
+    // The message still lives in the receive buffer - check if we are going
+    // to keep it before copying it out
+    auto msgid = cmd.msgid();
+    if (!msgid)
+    {
+        CHATID_LOG_ERROR("Received %s with a zero msgid, ignoring", isNew ? "NEWMSG" : "OLDMSG");
+        return CHATD_IDX_INVALID;
+    }
+    if (mIdToIndexMap.find(msgid) != mIdToIndexMap.end())
+    {
+        CHATID_LOG_WARNING("Received %s for message %s, which we already have, ignoring",
+            isNew ? "NEWMSG" : "OLDMSG", ID_CSTR(msgid));
+        if (!isNew)
+            mLastServerHistFetchCount++; //the server did send us history
+        return CHATD_IDX_INVALID;
+    }
+    //an old message is not kept in RAM if there is db history that is not loaded
+    return msgIncoming(isNew, (isNew || !mHasMoreHistoryInDb)
+        ? cmd.toMessage(&mMsgArena, isNew ? MsgArena::kNewer : MsgArena::kOlder)
+        : cmd.toMessage());
+}
+
 /* We have 3 stages:
  - add to history buffer, allocating an index
  - decrypt - may not happen asynchronous if crypto needs to fetch stuff from network.
@@ -2018,6 +2263,14 @@ Idx Chat::msgIncoming(bool isNew, Message* message, bool isLocal)
                 //all history is in RAM, determine the index from RAM
                 push_back(message);
                 idx = lownum();
+                //shouldn't we update this only after we save the msg to db?
+                mOldestKnownMsgId = msgid;
+                mIdToIndexMap[msgid] = idx;
+                handleLastReceivedSeen(msgid);
+                //defer decryption, saving to db and notifying the app until HISTDONE
+                if (mOldMsgBatchStart == CHATD_IDX_INVALID)
+                    mOldMsgBatchStart = idx;
+                return idx;
             }
             //shouldn't we update this only after we save the msg to db?
             mOldestKnownMsgId = msgid;
@@ -2063,6 +2316,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
 
     if (at(idx).isEncrypted() != 1)
     {
+        histMemoryChanged(msg);
         CHATID_LOG_DEBUG("handleLegacyKeys already decrypted msg %s, bailing out", ID_CSTR(msg.id()));
         return true;
     }
@@ -2156,14 +2410,21 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
             // Local messages are always decrypted, this is handled
             // at the start of this func
 
+            // Messages of an OLDMSG batch that is still being received are
+            // left for decryptOldMsgBatch()
+
             assert(!isLocal);
             auto first = mDecryptOldHaltedAt - 1;
             mDecryptOldHaltedAt = CHATD_IDX_INVALID;
-            auto last = lownum();
-            for (Idx i = first; i >= last; i--)
+            auto last = (mOldMsgBatchStart != CHATD_IDX_INVALID)
+                ? mOldMsgBatchStart + 1 : lownum();
             {
-                if (!msgIncomingAfterAdd(isNew, false, at(i), i))
-                    break;
+                HistBatchGuard batch(*this);
+                for (Idx i = first; i >= last; i--)
+                {
+                    if (!msgIncomingAfterAdd(isNew, false, at(i), i))
+                        break;
+                }
             }
             if ((mServerFetchState == kHistDecryptingOld) &&
                 (mDecryptOldHaltedAt == CHATD_IDX_INVALID))
@@ -2184,6 +2445,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
 void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx idx)
 {
     assert(idx != CHATD_IDX_INVALID);
+    histMemoryChanged(msg); //decrypted
     if (!isNew)
     {
         mLastHistDecryptCount++;
@@ -2202,6 +2464,11 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
 
         verifyMsgOrder(msg, idx);
         CALL_DB(addMsgToHistory, msg, idx);
+        if ((msg.userid != mClient.mUserId) &&
+           ((mLastSeenIdx == CHATD_IDX_INVALID) || (idx > mLastSeenIdx)))
+        {
+            setUnreadCount(mUnreadCount+1);
+        }
         if ((msg.userid != mClient.mUserId) &&
            ((mLastReceivedIdx == CHATD_IDX_INVALID) || (idx > mLastReceivedIdx)))
         {
@@ -2213,6 +2480,9 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
     if (isNew)
     {
         CALL_LISTENER(onRecvNewMessage, idx, msg, status);
+        //newer messages may be pending decryption, so keep this one and the newer
+        if (mClient.maxHistoryBytesPerChat || mClient.maxHistoryBytes)
+            trimHistory(idx);
     }
     else
     {
@@ -2221,12 +2491,20 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
         // then always send to app
         if (isLocal || mServerOldHistCbEnabled)
         {
-            CALL_LISTENER(onRecvHistoryMessage, idx, msg, status, isLocal);
+            if (mHistBatch.depth)
+                histBatchAdd(msg, idx, status, isLocal);
+            else
+                CALL_LISTENER(onRecvHistoryMessage, idx, msg, status, isLocal);
         }
     }
 
     if (isNew || (mLastSeenIdx == CHATD_IDX_INVALID))
-        CALL_LISTENER(onUnreadChanged);
+    {
+        if (!isNew && mHistBatch.depth)
+            mHistBatch.unreadChanged = true;
+        else
+            CALL_LISTENER(onUnreadChanged);
+    }
 
     //handle last text message
     if (msg.isText())
@@ -2247,6 +2525,85 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
     onMsgTimestamp(msg.ts);
 }
 
+/* Decrypts, saves to db and notifies the app about the OLDMSGs received since the
+ * start of the current batch. Decryption goes in one pass from the newest to the
+ * oldest message, and all db writes are done in one transaction. If a message can't
+ * be decrypted immediately, the normal halt mechanism takes over for the rest.
+ */
+void Chat::decryptOldMsgBatch()
+{
+    if (mOldMsgBatchStart == CHATD_IDX_INVALID)
+        return;
+    auto first = mOldMsgBatchStart;
+    mOldMsgBatchStart = CHATD_IDX_INVALID;
+    auto last = lownum();
+    CHATID_LOG_DEBUG("Processing batch of %d history messages", first-last+1);
+    // Let the crypto module start decrypting the whole batch in parallel, the
+    // messages below are then decrypted in order, as the results become available
+    std::vector<Message*> encrypted;
+    for (Idx i = first; i >= last; i--)
+    {
+        auto& msg = at(i);
+        if (msg.isEncrypted() == 1)
+            encrypted.push_back(&msg);
+    }
+    if (!encrypted.empty())
+        mCrypto->preDecrypt(encrypted);
+    HistBatchGuard batch(*this);
+    for (Idx i = first; i >= last; i--)
+    {
+        if (!msgIncomingAfterAdd(false, false, at(i), i))
+            break;
+    }
+}
+
+void Chat::histBatchBegin()
+{
+    mHistBatch.depth++;
+    CALL_DB(beginBatch);
+}
+
+void Chat::histBatchAdd(Message& msg, Idx idx, Message::Status status, bool isLocal)
+{
+    auto& batch = mHistBatch;
+    if (!batch.msgs.empty() &&
+       ((idx != batch.newest-(Idx)batch.msgs.size()) || (isLocal != batch.isLocal)))
+    {
+        histBatchNotify(); //not contiguous with the messages collected so far
+    }
+    if (batch.msgs.empty())
+    {
+        batch.newest = idx;
+        batch.isLocal = isLocal;
+    }
+    batch.msgs.push_back(&msg);
+    batch.statuses.push_back(status);
+}
+
+void Chat::histBatchNotify()
+{
+    auto& batch = mHistBatch;
+    if (batch.msgs.empty())
+        return;
+    CALL_LISTENER(onRecvHistoryMessages, batch.newest, batch.msgs, batch.statuses, batch.isLocal);
+    batch.msgs.clear();
+    batch.statuses.clear();
+}
+
+void Chat::histBatchEnd()
+{
+    assert(mHistBatch.depth);
+    CALL_DB(commitBatch);
+    if (--mHistBatch.depth)
+        return;
+    histBatchNotify();
+    if (mHistBatch.unreadChanged)
+    {
+        mHistBatch.unreadChanged = false;
+        CALL_LISTENER(onUnreadChanged);
+    }
+}
+
 void Chat::onMsgTimestamp(uint32_t ts)
 {
     if (ts <= mLastMsgTs)
@@ -2309,6 +2666,7 @@ void Chat::onUserJoin(Id userid, Priv priv)
     else if (mOnlineState == kChatStateOnline)
     {
         mUsers.insert(userid);
+        mRecipients.reset();
         CALL_CRYPTO(onUserJoin, userid);
         CALL_LISTENER(onUserJoin, userid, priv);
     }
@@ -2324,6 +2682,7 @@ void Chat::onUserLeave(Id userid)
         throw std::runtime_error("onUserLeave received while not online");
 
     mUsers.erase(userid);
+    mRecipients.reset();
     CALL_CRYPTO(onUserLeave, userid);
     CALL_LISTENER(onUserLeave, userid);
 }
@@ -2343,6 +2702,7 @@ void Chat::onJoinComplete()
     if (mUsers != mUserDump)
     {
         mUsers.swap(mUserDump);
+        mRecipients.reset();
         CALL_CRYPTO(setUsers, &mUsers);
     }
     mUserDump.clear();
@@ -2372,6 +2732,7 @@ void Chat::resetGetHistory()
 {
     mNextHistFetchIdx = CHATD_IDX_INVALID;
     mServerOldHistCbEnabled = false;
+    trimHistory();
 }
 
 void Chat::setOnlineState(ChatState state)
@@ -8,11 +8,14 @@
 #include <map>
 #include <set>
 #include <list>
+#include <unordered_map>
 #include <deque>
+#include <memory>
 #include <base/promise.h>
 #include <base/timers.hpp>
 #include <base/trackDelete.h>
 #include "chatdMsg.h"
+#include "idHashMap.h"
 #include "url.h"
 #define CHATD_LOG_DEBUG(fmtString,...) KARERE_LOG_DEBUG(krLogChannel_chatd, fmtString, ##__VA_ARGS__)
 #define CHATD_LOG_INFO(fmtString,...) KARERE_LOG_INFO(krLogChannel_chatd, fmtString, ##__VA_ARGS__)
@@ -33,6 +36,9 @@ typedef int32_t Idx;
 #define CHATD_IDX_RANGE_MIDDLE 0
 #define CHATD_IDX_INVALID 0x7fffffff
 
+/// An immutable, shared set of chat members, to which a message is sent
+typedef std::shared_ptr<const karere::SetOfIds> RecipientSet;
+
 class Chat;
 class ICrypto;
 
@@ -97,6 +103,27 @@ public:
      */
     virtual void onRecvHistoryMessage(Idx idx, Message& msg, Message::Status status, bool isLocal){}
 
+    /** @brief A batch of history messages has been received, as a result of getHistory().
+     * History messages received from the server between the first OLDMSG and HISTDONE,
+     * as well as messages loaded from the local db, are passed to the app in batches,
+     * with one call per batch.
+     * @param newestIdx The index of the first message in \c msgs. The messages are
+     * contiguous in the history buffer and ordered from the newest to the oldest,
+     * i.e. \c msgs[i] has index \c newestIdx-i
+     * @param msgs The messages
+     * @param statuses The 'seen' status of each of the messages in \c msgs
+     * @param isLocal Whether the messages were loaded from the local db
+     * @note The default implementation calls \c onRecvHistoryMessage() for every
+     * message in the batch, so apps that don't care about batching don't need
+     * to implement this method
+     */
+    virtual void onRecvHistoryMessages(Idx newestIdx, const std::vector<Message*>& msgs,
+        const std::vector<Message::Status>& statuses, bool isLocal)
+    {
+        for (size_t i = 0; i < msgs.size(); i++)
+            onRecvHistoryMessage(newestIdx-(Idx)i, *msgs[i], statuses[i], isLocal);
+    }
+
     /**
      * @brief The retrieval of the requested history batch, via \c getHistory(), was completed
      * @param source The source from where the last message of the history
@@ -293,6 +320,12 @@ protected:
     promise::Promise<void> mConnectPromise;
     promise::Promise<void> mDisconnectPromise;
     promise::Promise<void> mLoginPromise;
+    /** Outgoing commands are accumulated here and sent as a single websocket
+     * frame at the end of the current event loop iteration, or as soon as the
+     * accumulated size reaches kMaxSendBatchBytes */
+    Buffer mSendBuf;
+    bool mSendFlushScheduled = false;
+    enum { kMaxSendBatchBytes = 64 * 1024 };
     Connection(Client& client, int shardNo): mClient(client), mShardNo(shardNo){}
     State state() { return mState; }
     bool isOnline() const
@@ -309,8 +342,16 @@ protected:
     void enableInactivityTimer();
     void disableInactivityTimer();
     void reset();
-// Destroys the buffer content
+/** @brief Queues the buffer for sending in the current batch. Takes over
+ * the buffer content.
+ * @returns \c false if we are offline, or if flushing a full batch failed */
     bool sendBuf(Buffer&& buf);
+    /** @brief Copies the data into the current batch. The websocket masks the batch
+     * in place, so the source data is left intact - i.e. commands kept for re-send */
+    bool sendBuf(const StaticBuffer& data);
+    bool onSendBufAppended();
+    /** @brief Sends the accumulated commands as one websocket frame */
+    bool flushSendBuf();
     promise::Promise<void> rejoinExistingChats();
     void resendPending();
     void join(karere::Id chatid);
@@ -435,20 +476,25 @@ class Chat: public karere::DeleteTrackable
 {
 ///@cond PRIVATE
 public:
+    class OutputQueue;
     struct SendingItem
     {
     protected:
         uint8_t mOpcode;
+        karere::Id mIndexedId; //the msg id under which OutputQueue indexes the item
+        friend class OutputQueue;
     public:
         uint64_t rowid;
  /** When sending a message, we attach the Message object here to avoid
   * double-converting it when queued as a raw command in Sending, and after
   * that (when server confirms) move it as a Message object to history buffer */
         Message* msg;
-        karere::SetOfIds recipients;
+        /** The chat members at the time the message was posted. Shared by all
+         * items posted while the membership didn't change */
+        RecipientSet recipients;
         uint8_t opcode() const { return mOpcode; }
         void setOpcode(uint8_t op) { mOpcode = op; }
-        SendingItem(uint8_t aOpcode, Message* aMsg, const karere::SetOfIds& aRcpts,
+        SendingItem(uint8_t aOpcode, Message* aMsg, const RecipientSet& aRcpts,
             uint64_t aRowid=0)
         : mOpcode(aOpcode), rowid(aRowid), msg(aMsg), recipients(aRcpts){}
         ~SendingItem(){ if (msg) delete msg; }
@@ -459,7 +505,68 @@ public:
             msg->keyid = keyid;
         }
     };
-    typedef std::list<SendingItem> OutputQueue;
+    /** @brief The send queue. Keeps the items in posting order, and also indexes
+     * them by the id (msgxid, or msgid for MSGUPD) of their message, so that
+     * confirmations and lookups by id don't scan the queue.
+     * Iterators are stable until the item is erased, so an iterator such as
+     * mNextUnsent can be kept across insertions and removals of other items.
+     * @note The id of a queued message must be changed only via changeMsgId(),
+     * so that the index follows it.
+     */
+    class OutputQueue
+    {
+    public:
+        typedef std::list<SendingItem>::iterator iterator;
+        typedef std::list<SendingItem>::const_iterator const_iterator;
+        typedef std::list<SendingItem>::reverse_iterator reverse_iterator;
+        typedef std::vector<iterator> ItemList;
+    protected:
+        std::list<SendingItem> mItems;
+        /** The items with a given message id, in queue order */
+        std::unordered_map<karere::Id, ItemList> mIdIndex;
+        void addToIndex(iterator it);
+        void removeFromIndex(iterator it);
+    public:
+        iterator begin() { return mItems.begin(); }
+        iterator end() { return mItems.end(); }
+        const_iterator begin() const { return mItems.begin(); }
+        const_iterator end() const { return mItems.end(); }
+        reverse_iterator rbegin() { return mItems.rbegin(); }
+        reverse_iterator rend() { return mItems.rend(); }
+        bool empty() const { return mItems.empty(); }
+        size_t size() const { return mItems.size(); }
+        SendingItem& front() { return mItems.front(); }
+        SendingItem& back() { return mItems.back(); }
+        template <class... Args>
+        void emplace_back(Args&&... args)
+        {
+            mItems.emplace_back(std::forward<Args>(args)...);
+            addToIndex(std::prev(mItems.end()));
+        }
+        iterator erase(iterator it)
+        {
+            removeFromIndex(it);
+            return mItems.erase(it);
+        }
+        void pop_front() { erase(mItems.begin()); }
+        void clear()
+        {
+            mIdIndex.clear();
+            mItems.clear();
+        }
+        /** @brief The items whose message has the specified id, in queue order.
+         * The list is invalidated by any change to the queue */
+        const ItemList& itemsWithId(karere::Id id) const
+        {
+            static const ItemList sEmpty;
+            auto it = mIdIndex.find(id);
+            return (it == mIdIndex.end()) ? sEmpty : it->second;
+        }
+        /** @brief Changes the id of the item's message, and re-indexes the item.
+         * The item goes at the end of the items with the new id, which is the queue
+         * order when the new id is a msgid just assigned by the server */
+        void changeMsgId(iterator it, karere::Id newId);
+    };
     struct ManualSendItem
     {
         Message* msg;
@@ -475,21 +582,28 @@ protected:
     Client& mClient;
     karere::Id mChatId;
     Idx mForwardStart;
-    std::vector<std::unique_ptr<Message>> mForwardList;
-    std::vector<std::unique_ptr<Message>> mBackwardList;
+    /// Backing store for the messages in mForwardList and mBackwardList
+    MsgArena mMsgArena;
+    std::vector<Message::Ptr> mForwardList;
+    std::vector<Message::Ptr> mBackwardList;
     OutputQueue mSending;
     OutputQueue::iterator mNextUnsent;
     bool mIsFirstJoin = true;
-    std::map<karere::Id, Idx> mIdToIndexMap;
+    karere::IdHashMap<karere::Id, Idx> mIdToIndexMap;
     karere::Id mLastReceivedId;
     Idx mLastReceivedIdx = CHATD_IDX_INVALID;
     karere::Id mLastSeenId;
     Idx mLastSeenIdx = CHATD_IDX_INVALID;
+    /// The number of messages from peers in the db history that are newer than
+    /// the last-seen message, or all of them if last-seen is not known.
+    /// Maintained incrementally, and persisted in the db
+    int mUnreadCount = 0;
     Listener* mListener;
     ChatState mOnlineState = kChatStateOffline;
     Priv mOwnPrivilege = PRIV_INVALID;
     karere::SetOfIds mUsers;
     karere::SetOfIds mUserDump; //< The initial dump of JOINs goes here, then after join is complete, mUsers is set to this in one step
+    RecipientSet mRecipients; //< Immutable snapshot of mUsers for the sending items, created on demand, and reset when mUsers changes
     /// db-supplied initial range, that we use until we see the message with mOldestKnownMsgId
     /// Before that happens, missing messages are supposed to be in the database and
     /// incrementally fetched from there as needed. After we see the mOldestKnownMsgId,
@@ -508,6 +622,10 @@ protected:
     bool mHaveAllHistory = false;
     bool mIsDisabled = false;
     Idx mNextHistFetchIdx = CHATD_IDX_INVALID;
+    /// When getHistory() was last called, for LRU unloading of history, see Client::maxHistoryBytes
+    uint64_t mLastHistUse = 0;
+    /// Memory used by the RAM history - the sum of Message::mHistMemory of its messages
+    size_t mHistoryBytes = 0;
     DbInterface* mDbInterface = nullptr;
     // last text message stuff
     LastTextMsgState mLastTextMsg;
@@ -543,28 +661,78 @@ protected:
      * of new messages may work synchronously and not be delayed.
      */
     Idx mDecryptOldHaltedAt = CHATD_IDX_INVALID;
+    /** When we receive a batch of OLDMSGs from the server, this is the index of the
+     * first (newest) message of the batch. The messages from that index down to lownum()
+     * are only added to the history buffer. They are decrypted, saved to db and passed
+     * to the app as a group, when HISTDONE is received (or when we disconnect). */
+    Idx mOldMsgBatchStart = CHATD_IDX_INVALID;
+    /** History messages that have been processed during a batch, but not yet passed
+     * to the app via \c Listener::onRecvHistoryMessages() */
+    struct HistBatch
+    {
+        unsigned depth = 0;
+        bool isLocal = false;
+        bool unreadChanged = false;
+        Idx newest = CHATD_IDX_INVALID;
+        std::vector<Message*> msgs;
+        std::vector<Message::Status> statuses;
+    };
+    HistBatch mHistBatch;
+    /** Begins a history batch on construction and ends it on destruction, so that
+     * the batch is also ended when message processing throws */
+    struct HistBatchGuard
+    {
+        Chat& mChat;
+        HistBatchGuard(Chat& chat): mChat(chat) { mChat.histBatchBegin(); }
+        ~HistBatchGuard() { mChat.histBatchEnd(); }
+    };
     uint32_t mLastMsgTs;
     // ====
     std::map<karere::Id, Message*> mPendingEdits;
-    std::map<BackRefId, Idx> mRefidToIdxMap;
+    karere::IdHashMap<BackRefId, Idx> mRefidToIdxMap;
     Chat(Connection& conn, karere::Id chatid, Listener* listener,
          const karere::SetOfIds& users, uint32_t chatCreationTs, ICrypto* crypto);
-    void push_forward(Message* msg) { mForwardList.emplace_back(msg); }
-    void push_back(Message* msg) { mBackwardList.emplace_back(msg); }
+    void push_forward(Message* msg) { mForwardList.emplace_back(msg); histMemoryUpdate(*msg); }
+    void push_back(Message* msg) { mBackwardList.emplace_back(msg); histMemoryUpdate(*msg); }
     Message* oldest() const { return (!mBackwardList.empty()) ? mBackwardList.back().get() : mForwardList.front().get(); }
     Message* newest() const { return (!mForwardList.empty())? mForwardList.back().get() : mBackwardList.front().get(); }
     void clear()
     {
         mBackwardList.clear();
         mForwardList.clear();
+        mHistoryBytes = 0;
+    }
+    static size_t msgMemory(const Message& msg)
+    {
+        return sizeof(Message) + msg.bufSize() + msg.backRefs.capacity() * sizeof(BackRefId);
+    }
+    /** Accounts a message that is added to the RAM history, or whose content has
+     * changed while in it. Messages that are not in the RAM history are accounted
+     * only when added */
+    void histMemoryUpdate(Message& msg)
+    {
+        auto mem = msgMemory(msg);
+        mHistoryBytes = mHistoryBytes - msg.mHistMemory + mem;
+        msg.mHistMemory = (uint32_t)mem;
+    }
+    void histMemoryChanged(Message& msg)
+    {
+        if (msg.mHistMemory)
+            histMemoryUpdate(msg);
     }
     // msgid can be 0 in case of rejections
     Idx msgConfirm(karere::Id msgxid, karere::Id msgid);
     bool msgAlreadySent(karere::Id msgxid, karere::Id msgid);
     Message* msgRemoveFromSending(karere::Id msgxid, karere::Id msgid);
     Idx msgIncoming(bool isNew, Message* msg, bool isLocal=false);
+    Idx msgIncoming(bool isNew, const MsgCommandView& cmd);
     bool msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx);
     void msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx idx);
+    void decryptOldMsgBatch();
+    void histBatchBegin();
+    void histBatchAdd(Message& msg, Idx idx, Message::Status status, bool isLocal);
+    void histBatchNotify();
+    void histBatchEnd();
     void onUserJoin(karere::Id userid, Priv priv);
     void onUserLeave(karere::Id userid);
     void onJoinComplete();
@@ -575,6 +743,8 @@ protected:
     HistSource getHistoryFromDbOrServer(unsigned count);
     void onLastReceived(karere::Id msgid);
     void onLastSeen(karere::Id msgid);
+    void onLastSeenIdxChanged(Idx oldIdx);
+    void setUnreadCount(int count);
     void handleLastReceivedSeen(karere::Id msgid);
     // As sending data over libws is destructive to the buffer, we have two versions
     // of sendCommand - the one with the rvalue reference is picked by the compiler
@@ -611,6 +781,9 @@ public:
     ~Chat();
     /** @brief The chatid of this chat */
     karere::Id chatId() const { return mChatId; }
+    /** @brief The arena in which history messages of this chat are created, i.e.
+     * by the DbInterface when loading history, see \c Message::create() */
+    MsgArena& msgArena() { return mMsgArena; }
     /** @brief The chatd client */
     Client& client() const { return mClient; }
     /** @brief The lowest index of a message in the RAM history buffer */
@@ -959,6 +1132,9 @@ protected:
     void moveItemToManualSending(OutputQueue::iterator it, ManualSendReason reason);
     void handleTruncate(const Message& msg, Idx idx);
     void deleteMessagesBefore(Idx idx);
+    size_t historyMemory() const { return mHistoryBytes; }
+    size_t unloadOldHistory(size_t bytes, Idx keepFrom=CHATD_IDX_INVALID);
+    void trimHistory(Idx keepFrom=CHATD_IDX_INVALID);
     void createMsgBackRefs(Message& msg);
     void verifyMsgOrder(const Message& msg, Idx idx);
     /**
@@ -995,13 +1171,28 @@ protected:
             throw std::runtime_error("chatidConn: Unknown chatid "+chatid.toString());
         return *it->second;
     }
+    uint64_t mHistUseCounter = 0;
     bool onMsgAlreadySent(karere::Id msgxid, karere::Id msgid);
     void msgConfirm(karere::Id msgxid, karere::Id msgid);
+    void enforceHistoryBudget();
 public:
     enum: uint32_t { kOptManualResendWhenUserJoins = 1 };
     static ws_base_s sWebsocketContext;
     unsigned inactivityCheckIntervalSec = 20;
     uint32_t options = 0;
+    /** @brief Budget of the in-RAM history, in bytes (message objects and their
+     * payloads), per chat and for all chats together. Zero (the default) means
+     * no limit.
+     * When exceeded, the oldest messages of chats whose history is not being
+     * iterated by the app (i.e. after \c Chat::resetGetHistory()) are unloaded,
+     * least recently used chats first. Only messages that are already saved in
+     * the db are unloaded, and \c getHistory() reloads them from there.
+     * @note Enabling this changes the API contract: after \c resetGetHistory(),
+     * the app must not keep references to the messages it has received, except
+     * the newest one, and unloaded messages can't be found by msgid or idx
+     * (i.e. via \c Chat::msgIndexFromId()) until \c getHistory() reloads them. */
+    size_t maxHistoryBytesPerChat = 0;
+    size_t maxHistoryBytes = 0;
     karere::Id userId() const { return mUserId; }
     Client(karere::Id userId);
     ~Client(){}
@@ -1039,6 +1230,12 @@ class DbInterface
 {
 public:
     virtual void getHistoryInfo(ChatDbInfo& info) = 0;
+    /** @brief Called before a group of related writes, such as saving a batch of
+     * history messages. The implementation may defer committing the writes until
+     * the matching \c commitBatch() call. Calls can be nested. */
+    virtual void beginBatch() {}
+    /** @brief Ends a group of writes, started by \c beginBatch() */
+    virtual void commitBatch() {}
     /// Called when the client was requested to fetch history, and it knows the db contains the requested
     /// history range.
     /// @param startIdx - the start index of the requested history range
@@ -1062,6 +1259,12 @@ public:
     virtual void updateMsgInHistory(karere::Id msgid, const Message& msg) = 0;
     virtual Idx getIdxOfMsgid(karere::Id msgid) = 0;
     virtual Idx getPeerMsgCountAfterIdx(Idx idx) = 0;
+    /** Returns the number of messages from peers with idx in the range [first, last] */
+    virtual Idx getPeerMsgCountInRange(Idx first, Idx last) = 0;
+    /** Loads the persisted unread count of the chat. Returns false if it has
+     * not been stored yet, in which case it has to be recalculated */
+    virtual bool getUnreadCount(int& count) = 0;
+    virtual void setUnreadCount(int count) = 0;
     virtual void saveItemToManualSending(const Chat::SendingItem& item, int reason) = 0;
     virtual void loadManualSendItems(std::vector<Chat::ManualSendItem>& items) = 0;
     virtual bool deleteManualSendItem(uint64_t rowid) = 0;
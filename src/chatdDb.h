@@ -12,6 +12,63 @@ protected:
     chatd::Chat& mMessages;
     std::string mSendingTblName;
     std::string mHistTblName;
+    unsigned mBatchDepth = 0;
+    unsigned mBatchWrites = 0;
+    // The idx range of the db history of this chat, maintained in memory so that
+    // addMsgToHistory() doesn't have to query it on every insert
+    bool mHasIdxRange = false;
+    chatd::Idx mIdxLow = 0;
+    chatd::Idx mIdxHigh = 0;
+    // The recipient set of the last saved sending item, and its recipient_sets row.
+    // Consecutive items usually share the same set, which is then not even looked up
+    chatd::RecipientSet mLastRcptSet;
+    int64_t mLastRcptSetId = 0;
+    static int64_t rcptSetHash(const Buffer& data)
+    {
+        //FNV-1a
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < data.dataSize(); i++)
+        {
+            hash ^= (unsigned char)data.buf()[i];
+            hash *= 0x100000001b3ULL;
+        }
+        return (int64_t)hash;
+    }
+    /** @brief Returns the id of the recipient_sets row with the specified set,
+     * inserting it if there is no such row */
+    int64_t rcptSetId(const chatd::RecipientSet& rcpts)
+    {
+        if (rcpts == mLastRcptSet)
+            return mLastRcptSetId;
+        Buffer data(rcpts->size()*8);
+        rcpts->save(data);
+        auto hash = rcptSetHash(data);
+        int64_t id = 0;
+        {
+            SqliteStmt stmt(mDb, "select id, users from recipient_sets where chatid=? and hash=?");
+            stmt << mMessages.chatId() << hash;
+            Buffer users;
+            while (stmt.step())
+            {
+                stmt.blobCol(1, users);
+                if ((users.dataSize() == data.dataSize())
+                 && (memcmp(users.buf(), data.buf(), data.dataSize()) == 0))
+                {
+                    id = stmt.int64Col(0);
+                    break;
+                }
+            }
+        }
+        if (!id)
+        {
+            sqliteQuery(mDb, "insert into recipient_sets(chatid, hash, users) values(?,?,?)",
+                mMessages.chatId(), hash, data);
+            id = sqlite3_last_insert_rowid(mDb);
+        }
+        mLastRcptSet = rcpts;
+        mLastRcptSetId = id;
+        return id;
+    }
 public:
     ChatdSqliteDb(chatd::Chat& msgs, sqlite3* db, const std::string& sendingTblName="sending", const std::string& histTblName="history")
         :mDb(db), mMessages(msgs), mSendingTblName(sendingTblName), mHistTblName(histTblName){}
@@ -24,8 +81,12 @@ public:
         if (sqlite3_column_type(stmt, 0) == SQLITE_NULL) //no db history
         {
             memset(&info, 0, sizeof(info)); //actually need to zero only oldestDbId
+            mHasIdxRange = false;
             return;
         }
+        mHasIdxRange = true;
+        mIdxLow = minIdx;
+        mIdxHigh = info.newestDbIdx;
         SqliteStmt stmt2(mDb, "select msgid from "+mHistTblName+" where chatid=?1 and idx=?2");
         stmt2 << mMessages.chatId() << minIdx;
         stmt2.stepMustHaveData();
@@ -57,24 +118,48 @@ public:
            .append(std::to_string(actual));
         throw std::runtime_error(msg);
     }
+    // Writes are group-committed, see SqliteGroupCommit
     void commit()
     {
-        sqliteSimpleQuery(mDb, "COMMIT TRANSACTION");
-        sqliteSimpleQuery(mDb, "BEGIN TRANSACTION");
+        if (mBatchDepth) //will be registered at the end of the batch
+        {
+            mBatchWrites++;
+            return;
+        }
+        SqliteGroupCommit::get(mDb).onWrite();
+    }
+    // For writes that must be durable before we send something to the server
+    void commitNow()
+    {
+        auto& gc = SqliteGroupCommit::get(mDb);
+        gc.onWrite();
+        gc.flush();
+    }
+    virtual void beginBatch()
+    {
+        mBatchDepth++;
+    }
+    virtual void commitBatch()
+    {
+        assert(mBatchDepth);
+        if ((--mBatchDepth == 0) && mBatchWrites)
+        {
+            SqliteGroupCommit::get(mDb).onWrite(mBatchWrites);
+            mBatchWrites = 0;
+        }
     }
     void saveMsgToSending(chatd::Chat::SendingItem& item)
     {
         assert(item.msg);
         assert(item.isMessage());
         auto msg = item.msg;
-        Buffer rcpts;
-        item.recipients.save(rcpts);
+        auto rcptSet = rcptSetId(item.recipients);
         sqliteQuery(mDb, "insert into sending (chatid, opcode, ts, msgid, msg, type, updated, "
-                         "recipients, backrefid, backrefs) values(?,?,?,?,?,?,?,?,?,?)",
+                         "recipients, rcptset, backrefid, backrefs) values(?,?,?,?,?,?,?,x'',?,?,?)",
             (uint64_t)mMessages.chatId(), item.opcode(), (int)time(NULL), msg->id(),
-            *msg, msg->type, msg->updated, rcpts, msg->backRefId, msg->backrefBuf());
+            *msg, msg->type, msg->updated, rcptSet, msg->backRefId, msg->backrefBuf());
         item.rowid = sqlite3_last_insert_rowid(mDb);
-        commit();
+        commitNow();
     }
     virtual void updateMsgInSending(const chatd::Chat::SendingItem& item)
     {
@@ -82,14 +167,14 @@ public:
         sqliteQuery(mDb, "update sending set msg = ?, updated = ? where rowid = ?",
             *item.msg, item.msg->updated, item.rowid);
         assertAffectedRowCount(1, "updateMsgInSending");
-        commit();
+        commitNow();
     }
     virtual void confirmKeyOfSendingItem(uint64_t rowid, chatd::KeyId keyid)
     {
         sqliteQuery(mDb, "update sending set keyid = ? where rowid = ?",
                     keyid, rowid);
         assertAffectedRowCount(1, "confirmKeyOfSendingItem");
-        commit();
+        commitNow();
     }
     virtual void addBlobsToSendingItem(uint64_t rowid,
                     const chatd::MsgCommand* msgCmd, const chatd::Command* keyCmd)
@@ -102,7 +187,7 @@ public:
             msgCmd?static_cast<StaticBuffer>(*msgCmd):StaticBuffer(nullptr, 0),
             keyCmd?static_cast<StaticBuffer>(*keyCmd):StaticBuffer(nullptr, 0), rowid);
         assertAffectedRowCount(1,"addCommandBlobToSendingItem");
-        commit();
+        commitNow();
     }
     virtual void sendingItemMsgupdxToMsgupd(const chatd::Chat::SendingItem& item, karere::Id msgid)
     {
@@ -111,7 +196,7 @@ public:
             "update sending set opcode=?, msgid=? where chatid=? and rowid=? and opcode=? and msgid=?",
             chatd::OP_MSGUPD, msgid, mMessages.chatId(), item.rowid, chatd::OP_MSGUPDX, item.msg->id());
         assertAffectedRowCount(1, "updateSendingItemMsgidAndOpcode");
-        commit();
+        commitNow();
     }
     virtual void deleteItemFromSending(uint64_t rowid)
     {
@@ -123,37 +208,64 @@ public:
     {
         sqliteQuery(mDb, "update sending set msg = ? where rowid = ?", data, rowid);
         assertAffectedRowCount(1, "updateMsgPlaintextInSending");
-        commit();
+        commitNow();
     }
     virtual void updateMsgKeyIdInSending(uint64_t rowid, chatd::KeyId keyid)
     {
         sqliteQuery(mDb, "update sending set keyid = ? where rowid = ?", keyid, rowid);
         assertAffectedRowCount(1, "updateMsgKeyIdInSending");
-        commit();
+        commitNow();
     }
     virtual void addMsgToHistory(const chatd::Message& msg, chatd::Idx idx)
     {
-#if 1
-        SqliteStmt stmt(mDb, "select min(idx), max(idx), count(*) from history where chatid = ?");
-        stmt << mMessages.chatId();
-        stmt.step();
-        int low = stmt.intCol(0);
-        int high = stmt.intCol(1);
-        int count = stmt.intCol(2);
-        if ((count > 0) && (idx != low-1) && (idx != high+1))
+        // The cached range is updated only after the insert succeeds, so that it
+        // stays in sync with the db if the insert throws
+        chatd::Idx newLow = mIdxLow;
+        chatd::Idx newHigh = mIdxHigh;
+        if (!mHasIdxRange)
+        {
+            newLow = newHigh = idx;
+        }
+        else if (idx == mIdxHigh+1)
+        {
+            newHigh = idx;
+        }
+        else if (idx == mIdxLow-1)
+        {
+            newLow = idx;
+        }
+        else
         {
             CHATD_LOG_ERROR("chatid %s: addMsgToHistory: history discontinuity detected: "
                 "index of added msg %s is not adjacent to neither end of db history: "
-                "add idx=%d, histlow=%d, histhigh=%d, histcount= %d, fwdStart=%d, lownum=%d, highnum=%d",
+                "add idx=%d, histlow=%d, histhigh=%d, fwdStart=%d, lownum=%d, highnum=%d",
                 mMessages.chatId().toString().c_str(), msg.id().toString().c_str(),
-                idx, low, high, count, mMessages.forwardStart(), mMessages.lownum(), mMessages.highnum());
+                idx, mIdxLow, mIdxHigh, mMessages.forwardStart(), mMessages.lownum(), mMessages.highnum());
             assert(false);
         }
+#ifndef NDEBUG
+        // Check that the cached range is in sync with the db - the neighbour
+        // of the new message must be there. This is an index lookup, not a scan
+        if (newLow != newHigh)
+        {
+            SqliteStmt stmt(mDb, "select 1 from history where chatid = ? and idx = ?");
+            stmt << mMessages.chatId() << ((idx == newHigh) ? idx-1 : idx+1);
+            if (!stmt.step())
+            {
+                CHATD_LOG_ERROR("chatid %s: addMsgToHistory: cached db history range "
+                    "[%d, %d] is out of sync with the db", mMessages.chatId().toString().c_str(),
+                    mIdxLow, mIdxHigh);
+                assert(false);
+            }
+        }
 #endif
         sqliteQuery(mDb, "insert into history"
             "(idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid) "
             "values(?,?,?,?,?,?,?,?,?,?)", idx, mMessages.chatId(), msg.id(), msg.keyid,
             msg.type, msg.userid, msg.ts, msg.updated, msg, msg.backRefId);
+        mHasIdxRange = true;
+        mIdxLow = newLow;
+        mIdxHigh = newHigh;
         commit();
     }
     virtual void updateMsgInHistory(karere::Id msgid, const chatd::Message& msg)
@@ -165,10 +277,19 @@ public:
     }
     virtual void loadSendQueue(chatd::Chat::OutputQueue& queue)
     {
-        SqliteStmt stmt(mDb, "select rowid, opcode, msgid, keyid, msg, type, "
-            "ts, updated, backrefid, backrefs, recipients from sending where chatid=? order by rowid asc");
+        // Drop the recipient sets that are no longer referenced. This is done only
+        // here, before the cached set of this chat is used
+        sqliteQuery(mDb, "delete from recipient_sets where chatid=?1 and id not in "
+            "(select rcptset from sending where chatid=?1 and rcptset is not null)",
+            mMessages.chatId());
+        mLastRcptSet.reset();
+        SqliteStmt stmt(mDb, "select s.rowid, s.opcode, s.msgid, s.keyid, s.msg, s.type, "
+            "s.ts, s.updated, s.backrefid, s.backrefs, s.recipients, s.rcptset, r.users "
+            "from sending s left join recipient_sets r on r.id = s.rcptset "
+            "where s.chatid=? order by s.rowid asc");
         stmt << mMessages.chatId();
         queue.clear();
+        std::map<int64_t, chatd::RecipientSet> rcptSets;
         while(stmt.step())
         {
             uint8_t opcode = stmt.intCol(1);
@@ -187,9 +308,25 @@ public:
                 stmt.blobCol(9, refs);
                 refs.read(0, msg->backRefs);
             }
-            Buffer recpts;
-            stmt.blobCol(10, recpts);
-            queue.emplace_back(opcode, msg, recpts, stmt.intCol(0));
+            chatd::RecipientSet rcpts;
+            if (sqlite3_column_type(stmt, 11) == SQLITE_NULL) //saved before the recipient_sets migration
+            {
+                Buffer data;
+                stmt.blobCol(10, data);
+                rcpts = std::make_shared<const karere::SetOfIds>(data);
+            }
+            else
+            {
+                auto& shared = rcptSets[stmt.int64Col(11)];
+                if (!shared)
+                {
+                    Buffer data;
+                    stmt.blobCol(12, data);
+                    shared = std::make_shared<const karere::SetOfIds>(data);
+                }
+                rcpts = shared;
+            }
+            queue.emplace_back(opcode, msg, rcpts, stmt.intCol(0));
         }
     }
     virtual void fetchDbHistory(chatd::Idx idx, unsigned count, std::vector<chatd::Message*>& messages)
@@ -205,8 +342,8 @@ public:
             karere::Id userid(stmt.uint64Col(1));
             unsigned ts = stmt.uintCol(2);
             chatd::KeyId keyid = stmt.uintCol(6);
-            Buffer buf;
-            stmt.blobCol(4, buf);
+            auto data = sqlite3_column_blob(stmt, 4);
+            auto dataLen = sqlite3_column_bytes(stmt, 4);
 #ifndef NDEBUG
             auto idx = stmt.intCol(5);
             if(idx != mMessages.lownum()-1-(int)messages.size()) //we go backward in history, hence the -messages.size()
@@ -217,8 +354,9 @@ public:
                 assert(false);
             }
 #endif
-            auto msg = new chatd::Message(msgid, userid, ts, stmt.intCol(8), std::move(buf),
-                false, keyid, (unsigned char)stmt.intCol(3));
+            auto msg = chatd::Message::create(mMessages.msgArena(), chatd::MsgArena::kOlder,
+                msgid, userid, ts, stmt.intCol(8), (const char*)data, dataLen,
+                keyid, (unsigned char)stmt.intCol(3));
             msg->backRefId = stmt.uint64Col(7);
             messages.push_back(msg);
         }
@@ -243,6 +381,28 @@ public:
         stmt.stepMustHaveData("get peer msg count");
         return stmt.intCol(0);
     }
+    virtual chatd::Idx getPeerMsgCountInRange(chatd::Idx first, chatd::Idx last)
+    {
+        SqliteStmt stmt(mDb, "select count(*) from history where (chatid = ?) "
+            "and (userid != ?) and (idx >= ?) and (idx <= ?)");
+        stmt << mMessages.chatId() << mMessages.client().userId() << first << last;
+        stmt.stepMustHaveData("get peer msg count in range");
+        return stmt.intCol(0);
+    }
+    virtual bool getUnreadCount(int& count)
+    {
+        SqliteStmt stmt(mDb, "select unread_count from chats where chatid=?");
+        stmt << mMessages.chatId();
+        if (!stmt.step() || (sqlite3_column_type(stmt, 0) == SQLITE_NULL))
+            return false;
+        count = stmt.intCol(0);
+        return true;
+    }
+    virtual void setUnreadCount(int count)
+    {
+        sqliteQuery(mDb, "update chats set unread_count=? where chatid=?", count, mMessages.chatId());
+        commit();
+    }
     virtual void saveItemToManualSending(const chatd::Chat::SendingItem& item, int reason)
     {
         auto& msg = *item.msg;
@@ -279,6 +439,8 @@ public:
         if (idx == CHATD_IDX_INVALID)
             throw std::runtime_error("dbInterface::truncateHistory: msgid "+msg.id().toString()+" does not exist in db");
         sqliteQuery(mDb, "delete from history where chatid = ? and idx < ?", mMessages.chatId(), idx);
+        if (mHasIdxRange && (mIdxLow < idx))
+            mIdxLow = idx;
 #if 1
         SqliteStmt stmt(mDb, "select type from history where chatid=? and msgid=?");
         stmt << mMessages.chatId() << msg.id();
@@ -85,6 +85,19 @@ public:
         }, delay);
         return pms;
     }
+/**
+ * @brief A hint that the specified messages are about to be decrypted via
+ * \c msgDecrypt(), in this order. The crypto module may start decrypting them
+ * ahead of time, i.e. in parallel on other threads. \c msgDecrypt() must still
+ * be called for each of them, and the results are delivered via it, as usual.
+ */
+    virtual void preDecrypt(const std::vector<Message*>& msgs) {}
+/**
+ * @brief The messages passed to \c preDecrypt() that have not been passed to
+ * \c msgDecrypt() yet will not be - i.e. they were removed from the history buffer.
+ * The crypto module should release any results it keeps for them.
+ */
+    virtual void cancelPreDecrypt() {}
 /**
  * @brief The chatroom connection (to the chatd server shard) state state has changed.
  */
@@ -3,8 +3,10 @@
 
 #include <stdint.h>
 #include <string>
+#include <memory>
 #include <buffer.h>
 #include "karereId.h"
+#include "chatdMsgArena.h"
 
 enum { CHATD_KEYID_INVALID = 0, CHATD_KEYID_UNCONFIRMED = 0xffffffff };
 
@@ -12,6 +14,7 @@ namespace chatd
 {
 
 typedef uint32_t KeyId;
+class Chat;
 typedef uint64_t BackRefId;
 
 enum { kMaxBackRefs = 32 };
@@ -173,7 +176,7 @@ public:
         kNotSeen, //< User hasn't read this message yet
         kSeen //< User has read this message
     };
-    enum { kFlagForceNonText = 0x01 };
+    enum { kFlagForceNonText = 0x01, kFlagInArena = 0x02 };
     /** @brief Info recorder in a management message.
      * When a message is a management message, _and_ it needs to carry additional
      * info besides the standard fields (such as sender), the additional data
@@ -211,6 +214,8 @@ private:
 protected:
     uint8_t mIsEncrypted = 0; //0 = not encrypted, 1 = encrypted, 2 = encrypted, there was a decrypt error
     uint8_t mFlags = 0;
+    uint32_t mHistMemory = 0; //bytes accounted to the RAM history of the chat, zero if not in it
+    friend class Chat;
 public:
     karere::Id userid;
     uint32_t ts;
@@ -236,6 +241,57 @@ public:
             KeyId aKeyid=CHATD_KEYID_INVALID, unsigned char aType=kMsgInvalid, void* aUserp=nullptr)
         :Buffer(msg, msglen), mId(aMsgid), mIdIsXid(aIsSending), userid(aUserid), ts(aTs),
             updated(aUpdated), keyid(aKeyid), type(aType), userp(aUserp){}
+protected:
+    // For create() - the payload is stored in the \c inlineSize bytes at \c inlineBuf,
+    // right after the object, until it outgrows them
+    Message(karere::Id aMsgid, karere::Id aUserid, uint32_t aTs, uint16_t aUpdated,
+            const char* msg, size_t msglen, char* inlineBuf, size_t inlineSize,
+            KeyId aKeyid, unsigned char aType)
+        :Buffer(msglen, inlineBuf, inlineSize), mId(aMsgid), mFlags(kFlagInArena),
+            userid(aUserid), ts(aTs), updated(aUpdated), keyid(aKeyid), type(aType), userp(nullptr)
+    {
+        if (msglen)
+        {
+            memcpy(mBuf, msg, msglen);
+            mDataSize = msglen;
+        }
+    }
+public:
+    /** @brief Creates a history message in \c arena, with its payload in the same
+     * record. A message whose payload doesn't fit in a record is allocated on the heap.
+     * Either way, the message must be deleted via \c destroy() (i.e. owned by a
+     * \c Message::Ptr), and not via \c delete */
+    static Message* create(MsgArena& arena, MsgArena::Side side, karere::Id aMsgid,
+        karere::Id aUserid, uint32_t aTs, uint16_t aUpdated, const char* msg, size_t msglen,
+        KeyId aKeyid=CHATD_KEYID_INVALID, unsigned char aType=kMsgInvalid)
+    {
+        auto size = sizeof(Message)+msglen;
+        if (size > MsgArena::kMaxRecordSize)
+            return new Message(aMsgid, aUserid, aTs, aUpdated, msg, msglen, false, aKeyid, aType);
+        auto mem = static_cast<char*>(arena.alloc(size, side));
+        return new (mem) Message(aMsgid, aUserid, aTs, aUpdated, msg, msglen,
+            mem+sizeof(Message), MsgArena::usableSize(size)-sizeof(Message), aKeyid, aType);
+    }
+    /** @brief Deletes a message created either via \c new or via \c create() */
+    static void destroy(Message* msg)
+    {
+        if (!msg)
+            return;
+        if (msg->mFlags & kFlagInArena)
+        {
+            msg->~Message();
+            MsgArena::free(msg);
+        }
+        else
+        {
+            delete msg;
+        }
+    }
+    struct Deleter
+    {
+        void operator()(Message* msg) const { destroy(msg); }
+    };
+    typedef std::unique_ptr<Message, Deleter> Ptr;
 
     /** @brief Returns the ManagementInfo structure contained within the message
      * content. Throws if the message is not a management message, or if the
@@ -308,20 +364,28 @@ protected:
 
 class Command: public Buffer
 {
+public:
+    /** Commands up to this size (i.e. SEEN, RECEIVED, KEEPALIVE, JOIN, HIST)
+     * are built in the object itself, without a heap allocation */
+    enum { kInlineSize = 32 };
 private:
     Command(const Command&) = delete;
 protected:
     static const char* opcodeNames[];
+    char mInlineBuf[kInlineSize];
 public:
     enum { kBroadcastUserTyping = 1 };
     Command(): Buffer(){}
 
     Command(Command&& other)
-    : Buffer(std::forward<Buffer>(other))
-    { assert(!other.buf() && !other.bufSize() && !other.dataSize()); }
+    : Buffer(0, mInlineBuf, kInlineSize)
+    {
+        takeFrom(std::move(other));
+        assert(!other.buf() && !other.bufSize() && !other.dataSize());
+    }
 
-    explicit Command(uint8_t opcode, size_t reserve=64)
-    : Buffer(reserve) { write(0, opcode); }
+    explicit Command(uint8_t opcode, size_t reserve=kInlineSize)
+    : Buffer(reserve, mInlineBuf, kInlineSize) { write(0, opcode); }
 
     template<class T>
     Command&& operator+(const T& val)
@@ -363,6 +427,12 @@ public:
         append(chatid.val).append<uint32_t>(keyid).append<uint32_t>(0); //last is length of keys payload, initially empty
     }
     KeyCommand(): Command(){} //for db loading
+    /** @brief The size of a command with \c keyCount keys of \c keylen bytes each,
+     * to pre-size the buffer when the recipients are known */
+    static size_t sizeFor(size_t keyCount, size_t keylen)
+    {
+        return 17 + keyCount * (10 + keylen); //see addKey() and clearKeys()
+    }
     KeyId keyId() const { return read<uint32_t>(9); }
     void setChatId(karere::Id aChatId) { write<uint64_t>(1, aChatId.val); }
     void setKeyId(uint32_t keyid) { write(9, keyid); }
@@ -386,7 +456,7 @@ class MsgCommand: public Command
 public:
     explicit MsgCommand(uint8_t opcode, karere::Id chatid, karere::Id userid,
         karere::Id msgid, uint32_t ts, uint16_t updated, KeyId keyid=CHATD_KEYID_INVALID)
-    :Command(opcode)
+    :Command(opcode, 64)
     {
         write(1, chatid.val);write(9, userid.val);write(17, msgid.val);write(25, ts);
         write(29, updated);write(31, keyid);write(35, 0); //msglen
@@ -420,6 +490,57 @@ public:
     }
 };
 
+/** @brief A read-only view of an incoming command, pointing directly into the
+ * receive buffer, just after the opcode byte. Field access is not bounds-checked -
+ * the frame decoder in Connection::execCommand() validates the length of the
+ * whole command against its wire layout before creating a view for it.
+ */
+class CommandView
+{
+protected:
+    const char* mData;
+public:
+    explicit CommandView(const char* data): mData(data) {}
+    template <class T>
+    T read(size_t offset) const { return StaticBuffer::alignSafeRead<T>(mData+offset); }
+    karere::Id readId(size_t offset) const { return read<uint64_t>(offset); }
+    const char* ptr(size_t offset) const { return mData+offset; }
+};
+
+/** @brief View of an incoming OLDMSG, NEWMSG or MSGUPD command:
+ * <chatid.8> <userid.8> <msgid.8> <ts.4> <updated.2> <keyid.4> <msglen.4> <msg>
+ */
+class MsgCommandView: public CommandView
+{
+public:
+    enum { kHeaderSize = 38 };
+    explicit MsgCommandView(const char* data): CommandView(data) {}
+    karere::Id chatid() const { return readId(0); }
+    karere::Id userid() const { return readId(8); }
+    karere::Id msgid() const { return readId(16); }
+    uint32_t ts() const { return read<uint32_t>(24); }
+    uint16_t updated() const { return read<uint16_t>(28); }
+    KeyId keyid() const { return read<KeyId>(30); }
+    uint32_t msglen() const { return read<uint32_t>(34); }
+    const char* msgdata() const { return ptr(kHeaderSize); }
+    /** @brief Copies the message out of the receive buffer. This is the only
+     * point where the payload is copied, so it should be called only once we know
+     * that we are going to keep the message.
+     * @param arena If specified, the message is created in that arena, see
+     * \c Message::create(), at the \c side end of the history
+     */
+    Message* toMessage(MsgArena* arena=nullptr, MsgArena::Side side=MsgArena::kNewer) const
+    {
+        auto msg = arena
+            ? Message::create(*arena, side, msgid(), userid(), ts(), updated(),
+                              msgdata(), msglen(), keyid())
+            : new Message(msgid(), userid(), ts(), updated(), msgdata(), msglen(),
+                          false, keyid());
+        msg->setEncrypted(1);
+        return msg;
+    }
+};
+
 //for exception message purposes
 static inline std::string operator+(const char* str, karere::Id id)
 {
@@ -0,0 +1,142 @@
+#ifndef __CHATD_MSG_ARENA_H__
+#define __CHATD_MSG_ARENA_H__
+
+#include <stdlib.h>
+#include <cstddef>
+#include <assert.h>
+#include <new>
+
+namespace chatd
+{
+/** @brief A chunked arena for the history messages of a chat. Each message is
+ * stored together with its payload in a single record (see \c Message::create()),
+ * so instead of tens of thousands of separate small heap blocks, a range of
+ * consecutive messages sits in one chunk of \c kChunkSize bytes.
+ * Records are bump-allocated. Newer messages and older (history) messages each
+ * fill their own chunk, so that a chunk holds a range of consecutive indexes.
+ * A chunk is released with a single \c free() as soon as its last record is freed,
+ * so deleting a window of history returns its memory chunk by chunk, rather
+ * than message by message. The space of a record that is freed on its own is
+ * reused only once the whole chunk is empty.
+ *
+ * Every record is prefixed by a pointer to its chunk, padded to the maximum
+ * fundamental alignment (8 or 16 bytes, depending on the platform). A record may
+ * outlive its arena - the arena then leaves the non-empty chunks orphaned, and
+ * they are freed when their last record is freed.
+ * @note Not thread-safe. As the rest of chatd, must be used only from the GUI thread.
+ */
+class MsgArena
+{
+public:
+    /** The end of the history that a record is added to */
+    enum Side { kNewer = 0, kOlder = 1 };
+    enum { kChunkSize = 64 * 1024 };
+    /** Bigger records should be allocated on the heap, so that a chunk holds
+     * at least 16 of them */
+    enum { kMaxRecordSize = kChunkSize / 16 };
+protected:
+    enum { kAlign = alignof(std::max_align_t) };
+    struct Chunk
+    {
+        MsgArena* arena; //null if orphaned
+        Chunk* prev = nullptr;
+        Chunk* next = nullptr;
+        size_t used; //bytes handed out, including the chunk header
+        size_t live = 0; //records that are not freed yet
+        Chunk(MsgArena* aArena);
+    };
+    //padded to kAlign, so that the object after it is suitably aligned, as malloc()
+    //returns kAlign-aligned blocks, and chunk headers and records are multiples of it
+    struct alignas(std::max_align_t) RecordHeader
+    {
+        Chunk* chunk;
+    };
+    enum { kChunkHdrSize = (sizeof(Chunk) + kAlign - 1) & ~(kAlign - 1) };
+    Chunk* mChunks = nullptr; //doubly linked list of all chunks
+    Chunk* mCurrent[2] = {nullptr, nullptr}; //the chunk being filled, per side
+    size_t mChunkCount = 0;
+    Chunk* newChunk()
+    {
+        auto mem = ::malloc(kChunkSize);
+        if (!mem)
+            throw std::bad_alloc();
+        auto chunk = new (mem) Chunk(this);
+        chunk->next = mChunks;
+        if (mChunks)
+            mChunks->prev = chunk;
+        mChunks = chunk;
+        mChunkCount++;
+        return chunk;
+    }
+    void onChunkEmpty(Chunk* chunk)
+    {
+        if ((chunk == mCurrent[kNewer]) || (chunk == mCurrent[kOlder]))
+        {
+            chunk->used = kChunkHdrSize; //keep it, and fill it from the start
+            return;
+        }
+        if (chunk->prev)
+            chunk->prev->next = chunk->next;
+        else
+            mChunks = chunk->next;
+        if (chunk->next)
+            chunk->next->prev = chunk->prev;
+        mChunkCount--;
+        ::free(chunk);
+    }
+public:
+    MsgArena() {}
+    MsgArena(const MsgArena&) = delete;
+    MsgArena& operator=(const MsgArena&) = delete;
+    ~MsgArena()
+    {
+        auto chunk = mChunks;
+        while (chunk)
+        {
+            auto next = chunk->next;
+            if (chunk->live)
+                chunk->arena = nullptr; //will be freed by the last free()
+            else
+                ::free(chunk);
+            chunk = next;
+        }
+    }
+    /** @brief The usable size of a record allocated for \c size bytes */
+    static size_t usableSize(size_t size) { return (size + kAlign - 1) & ~(size_t)(kAlign - 1); }
+    /** @brief Allocates a record of \c size bytes, which must not be more than
+     * \c kMaxRecordSize. O(1) - a new chunk is started when the current one of
+     * that side is full */
+    void* alloc(size_t size, Side side)
+    {
+        auto recSize = sizeof(RecordHeader) + usableSize(size);
+        assert(size <= kMaxRecordSize);
+        auto chunk = mCurrent[side];
+        if (!chunk || (chunk->used + recSize > kChunkSize))
+            chunk = mCurrent[side] = newChunk();
+        auto hdr = reinterpret_cast<RecordHeader*>(reinterpret_cast<char*>(chunk) + chunk->used);
+        chunk->used += recSize;
+        chunk->live++;
+        hdr->chunk = chunk;
+        return hdr + 1;
+    }
+    /** @brief Frees a record returned by \c alloc() of any arena */
+    static void free(void* ptr)
+    {
+        if (!ptr)
+            return;
+        auto chunk = (static_cast<RecordHeader*>(ptr) - 1)->chunk;
+        assert(chunk->live);
+        if (--chunk->live)
+            return;
+        if (chunk->arena)
+            chunk->arena->onChunkEmpty(chunk);
+        else
+            ::free(chunk);
+    }
+    /** @brief The number of chunks currently allocated by the arena */
+    size_t chunkCount() const { return mChunkCount; }
+};
+
+inline MsgArena::Chunk::Chunk(MsgArena* aArena): arena(aArena), used(kChunkHdrSize) {}
+}
+#endif
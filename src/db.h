@@ -2,12 +2,148 @@
 #define _KARERE_DB_H
 
 #include <sqlite3.h>
+#include <map>
+#include <unordered_map>
+#include <base/timers.hpp>
+#include <karereCommon.h>
+
+/** @brief A per-connection cache of prepared statements, keyed by their SQL text.
+ * SqliteStmt takes its statement from the cache of its db connection, and returns
+ * it there, reset and with its bindings cleared, when destroyed. This way every
+ * distinct query is prepared only once. If the cached statement for a query is
+ * already in use (i.e. nested use of the same query), a separate, non-cached
+ * statement is prepared.
+ * @note sqlite refuses to close a connection that has unfinalized statements, so
+ * connections must be closed via \c sqliteCloseDb(), which first destroys the cache.
+ * @note Like the rest of the db code, this is not thread-safe. All access to a
+ * db connection must be done from one thread (the GUI thread).
+ */
+class SqliteStmtCache
+{
+public:
+    enum { kMaxStmts = 128 };
+protected:
+    struct SqlHash
+    {
+        size_t operator()(const char* sql) const
+        {
+            size_t hash = 2166136261u; //FNV-1a
+            for (; *sql; sql++)
+                hash = (hash ^ (unsigned char)*sql) * 16777619u;
+            return hash;
+        }
+    };
+    struct SqlEqual
+    {
+        bool operator()(const char* a, const char* b) const { return strcmp(a, b) == 0; }
+    };
+    struct Item
+    {
+        sqlite3_stmt* stmt;
+        bool inUse;
+    };
+    sqlite3* mDb;
+    // The key is the SQL text, as returned by sqlite3_sql(), so it is owned by the statement
+    std::unordered_map<const char*, Item, SqlHash, SqlEqual> mStmts;
+    uint64_t mHits = 0;
+    uint64_t mMisses = 0;
+    SqliteStmtCache(sqlite3* db): mDb(db) {}
+    ~SqliteStmtCache()
+    {
+        for (auto& item: mStmts)
+        {
+            assert(!item.second.inUse);
+            sqlite3_finalize(item.second.stmt);
+        }
+    }
+    static std::map<sqlite3*, SqliteStmtCache*>& caches()
+    {
+        static std::map<sqlite3*, SqliteStmtCache*> sCaches;
+        return sCaches;
+    }
+public:
+    /** @brief Returns the statement cache of the specified connection, creating it if needed */
+    static SqliteStmtCache& get(sqlite3* db)
+    {
+        auto& cacheMap = caches();
+        auto it = cacheMap.find(db);
+        if (it != cacheMap.end())
+            return *it->second;
+        auto cache = new SqliteStmtCache(db);
+        cacheMap[db] = cache;
+        return *cache;
+    }
+    /** @brief Finalizes all cached statements of the specified connection and
+     * destroys its cache. Must be called before closing the connection */
+    static void remove(sqlite3* db)
+    {
+        auto& cacheMap = caches();
+        auto it = cacheMap.find(db);
+        if (it == cacheMap.end())
+            return;
+        delete it->second;
+        cacheMap.erase(it);
+    }
+    static sqlite3_stmt* prepare(sqlite3* db, const char* sql)
+    {
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            const char* errMsg = sqlite3_errmsg(db);
+            if (!errMsg)
+                errMsg = "(Unknown error)";
+            throw std::runtime_error(std::string(
+                "Error creating sqlite statement with sql:\n'")+sql+"'\n"+errMsg);
+        }
+        assert(stmt);
+        return stmt;
+    }
+    /** @brief Returns a prepared statement for the specified SQL.
+     * @param[out] cached Set to \c true if the statement is owned by the cache and
+     * must be returned via \c release(). Otherwise the caller owns the statement and
+     * must finalize it.
+     */
+    sqlite3_stmt* acquire(const char* sql, bool& cached)
+    {
+        auto it = mStmts.find(sql);
+        if (it != mStmts.end() && !it->second.inUse)
+        {
+            mHits++;
+            it->second.inUse = true;
+            cached = true;
+            return it->second.stmt;
+        }
+        mMisses++;
+        auto stmt = prepare(mDb, sql);
+        // If the cached statement is currently in use, or the cache is full,
+        // the new statement is not cached
+        cached = (it == mStmts.end()) && (mStmts.size() < kMaxStmts);
+        if (cached)
+            mStmts.emplace(sqlite3_sql(stmt), Item{stmt, true});
+        return stmt;
+    }
+    /** @brief Returns a cached statement, obtained via \c acquire(), to the cache */
+    void release(sqlite3_stmt* stmt)
+    {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        auto it = mStmts.find(sqlite3_sql(stmt));
+        assert(it != mStmts.end() && it->second.stmt == stmt);
+        it->second.inUse = false;
+    }
+    /** @brief The number of times a statement was reused from the cache */
+    uint64_t hitCount() const { return mHits; }
+    /** @brief The number of times a statement had to be prepared */
+    uint64_t missCount() const { return mMisses; }
+    size_t size() const { return mStmts.size(); }
+};
 
 class SqliteStmt
 {
 protected:
     sqlite3_stmt* mStmt;
     sqlite3* mDb;
+    SqliteStmtCache* mCache = nullptr; //set if mStmt belongs to the cache
     int mLastBindCol = 0;
     void check(int code, const char* opname)
     {
@@ -36,20 +172,20 @@ public:
     SqliteStmt(sqlite3* db, const char* sql) :mDb(db)
     {
         assert(db);
-        if (sqlite3_prepare_v2(db, sql, -1, &mStmt, nullptr) != SQLITE_OK)
-        {
-            const char* errMsg = sqlite3_errmsg(mDb);
-            if (!errMsg)
-                errMsg = "(Unknown error)";
-            throw std::runtime_error(std::string(
-                "Error creating sqlite statement with sql:\n'")+sql+"'\n"+errMsg);
-        }
-        assert(mStmt);
+        auto& cache = SqliteStmtCache::get(db);
+        bool cached;
+        mStmt = cache.acquire(sql, cached);
+        if (cached)
+            mCache = &cache;
     }
     SqliteStmt(sqlite3 *db, const std::string& sql):SqliteStmt(db, sql.c_str()){}
     ~SqliteStmt()
     {
-        if (mStmt)
+        if (!mStmt)
+            return;
+        if (mCache)
+            mCache->release(mStmt);
+        else
             sqlite3_finalize(mStmt);
     }
     operator sqlite3_stmt*() { return mStmt; }
@@ -183,6 +319,152 @@ static inline void sqliteSimpleQuery(sqlite3* db, const char* sql)
     throw std::runtime_error(msg);
 }
 
+/** @brief Group commit for a db connection that always has an open transaction,
+ * which is committed and immediately re-opened to make the writes so far durable.
+ * Instead of committing (and syncing to disk) after every write, writes accumulate
+ * in the open transaction, until either \c maxPendingWrites writes are pending, or
+ * \c maxDelayMs milliseconds have passed since the first pending write.
+ * Writes whose durability matters for the protocol (i.e. send queue items that are
+ * about to be sent to the server) must be followed by an explicit \c flush().
+ * Setting \c maxPendingWrites to 1 disables grouping - every write is committed
+ * immediately.
+ * @note As the rest of the db code, this must be used only from the GUI thread.
+ */
+class SqliteGroupCommit
+{
+public:
+    enum { kDefaultMaxPendingWrites = 64, kDefaultMaxDelayMs = 1000 };
+    unsigned maxPendingWrites = kDefaultMaxPendingWrites;
+    unsigned maxDelayMs = kDefaultMaxDelayMs;
+protected:
+    sqlite3* mDb;
+    unsigned mPendingWrites = 0;
+    megaHandle mTimer = 0;
+    uint64_t mCommitCount = 0;
+    SqliteGroupCommit(sqlite3* db): mDb(db) {}
+    ~SqliteGroupCommit()
+    {
+        if (mTimer)
+            karere::cancelTimeout(mTimer);
+    }
+    static std::map<sqlite3*, SqliteGroupCommit*>& instances()
+    {
+        static std::map<sqlite3*, SqliteGroupCommit*> sInstances;
+        return sInstances;
+    }
+public:
+    /** @brief Returns the group commit instance of the specified connection,
+     * creating it if needed */
+    static SqliteGroupCommit& get(sqlite3* db)
+    {
+        auto& inst = instances();
+        auto it = inst.find(db);
+        if (it != inst.end())
+            return *it->second;
+        auto gc = new SqliteGroupCommit(db);
+        inst[db] = gc;
+        return *gc;
+    }
+    /** @brief Destroys the group commit instance of the specified connection,
+     * without committing. Must be called before closing the connection */
+    static void remove(sqlite3* db)
+    {
+        auto& inst = instances();
+        auto it = inst.find(db);
+        if (it == inst.end())
+            return;
+        delete it->second;
+        inst.erase(it);
+    }
+    /** @brief Registers \c count writes in the current transaction, and commits
+     * it if the pending write threshold is reached. Otherwise makes sure that
+     * the writes will be committed in at most \c maxDelayMs */
+    void onWrite(unsigned count=1)
+    {
+        if (!count)
+            return;
+        mPendingWrites += count;
+        if (mPendingWrites >= maxPendingWrites)
+        {
+            commit();
+            return;
+        }
+        if (mTimer)
+            return;
+        auto db = mDb;
+        mTimer = karere::setTimeout([db]()
+        {
+            auto& inst = instances();
+            auto it = inst.find(db);
+            if (it == inst.end())
+                return;
+            it->second->mTimer = 0;
+            try
+            {
+                it->second->flush();
+            }
+            catch(std::exception& e)
+            {
+                KR_LOG_ERROR("SqliteGroupCommit: Error committing pending writes: %s", e.what());
+            }
+        }, maxDelayMs);
+    }
+    /** @brief Commits the current transaction, if there are pending writes */
+    void flush()
+    {
+        if (mPendingWrites)
+            commit();
+    }
+    /** @brief Unconditionally commits the current transaction and starts a new one */
+    void commit()
+    {
+        if (mTimer)
+        {
+            karere::cancelTimeout(mTimer);
+            mTimer = 0;
+        }
+        sqliteSimpleQuery(mDb, "COMMIT TRANSACTION");
+        sqliteSimpleQuery(mDb, "BEGIN TRANSACTION");
+        mPendingWrites = 0;
+        mCommitCount++;
+    }
+    unsigned pendingWrites() const { return mPendingWrites; }
+    uint64_t commitCount() const { return mCommitCount; }
+};
+
+/** @brief Closes a db connection, finalizing the statements cached for it.
+ * Any writes not yet committed by the group commit are discarded */
+static inline int sqliteCloseDb(sqlite3* db)
+{
+    SqliteGroupCommit::remove(db);
+    SqliteStmtCache::remove(db);
+    return sqlite3_close(db);
+}
+
+/** @brief Applies, in order, the schema migrations that have not yet been applied
+ * to the db. The migration version of the db is kept in the \c vars table, under
+ * the name \c varName. Must be called within a transaction, which the caller commits.
+ * @returns The migration version of the db before the call
+ */
+static inline size_t sqliteApplyMigrations(sqlite3* db, const char* const* migrations,
+    size_t count, const char* varName="schema_migration")
+{
+    size_t ver = 0;
+    {
+        SqliteStmt stmt(db, "select value from vars where name = ?");
+        stmt << varName;
+        if (stmt.step())
+            ver = stmt.intCol(0);
+    }
+    if (ver >= count)
+        return ver;
+    for (size_t i = ver; i < count; i++)
+        sqliteSimpleQuery(db, migrations[i]);
+    sqliteQuery(db, "insert or replace into vars(name, value) values(?, ?)",
+        varName, (int)count);
+    return ver;
+}
+
 class SqliteTransaction
 {
 protected:
@@ -0,0 +1,155 @@
+#ifndef _ID_HASH_MAP_H_INCLUDED_
+#define _ID_HASH_MAP_H_INCLUDED_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+namespace karere
+{
+/** @brief An open-addressing (linear probing) hash map keyed by 64-bit ids, such as
+ * msgids and backref ids. Entries are stored inline in a single array, so there
+ * is no per-entry allocation, and lookups touch one or two cache lines.
+ * The interface mimics the subset of std::map that is used for such indexes -
+ * \c find() returns a pointer to a {first, second} entry, and \c end() is \c nullptr,
+ * so code like <tt>auto it = map.find(id); if (it != map.end()) use(it->second);</tt>
+ * works unchanged.
+ * @note The key value 0 is reserved as the empty slot marker and can't be stored -
+ * \c find(0) always returns \c end(), and inserting it throws std::invalid_argument.
+ * Entry pointers are invalidated by insertion and removal.
+ */
+template <class K, class V>
+class IdHashMap
+{
+public:
+    struct Entry
+    {
+        K first;
+        V second;
+    };
+    enum { kMinCapacity = 16 }; //must be a power of 2
+protected:
+    Entry* mEntries = nullptr;
+    size_t mCapacity = 0; //always a power of 2
+    size_t mCount = 0;
+    // The MurmurHash3 64-bit finalizer. Ids are mostly random, but this makes
+    // sequential or otherwise structured ids safe as well
+    static size_t slotOf(uint64_t key, size_t mask)
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return (size_t)key & mask;
+    }
+    static bool isEmpty(const Entry& entry) { return (uint64_t)entry.first == 0; }
+    Entry* lookup(uint64_t key) const
+    {
+        //0 is the empty slot marker, so it would match any empty slot
+        if (!mCount || !key)
+            return nullptr;
+        auto mask = mCapacity - 1;
+        for (auto i = slotOf(key, mask);; i = (i + 1) & mask)
+        {
+            auto& entry = mEntries[i];
+            if ((uint64_t)entry.first == key)
+                return &entry;
+            if (isEmpty(entry))
+                return nullptr;
+        }
+    }
+    void rehash(size_t newCapacity)
+    {
+        auto entries = static_cast<Entry*>(::calloc(newCapacity, sizeof(Entry)));
+        if (!entries)
+            throw std::bad_alloc();
+        auto mask = newCapacity - 1;
+        for (size_t i = 0; i < mCapacity; i++)
+        {
+            auto& entry = mEntries[i];
+            if (isEmpty(entry))
+                continue;
+            auto slot = slotOf(entry.first, mask);
+            while (!isEmpty(entries[slot]))
+                slot = (slot + 1) & mask;
+            entries[slot] = entry;
+        }
+        ::free(mEntries);
+        mEntries = entries;
+        mCapacity = newCapacity;
+    }
+public:
+    IdHashMap() {}
+    IdHashMap(const IdHashMap&) = delete;
+    IdHashMap& operator=(const IdHashMap&) = delete;
+    ~IdHashMap() { ::free(mEntries); }
+    Entry* end() const { return nullptr; }
+    Entry* find(uint64_t key) const { return lookup(key); }
+    size_t size() const { return mCount; }
+    bool empty() const { return mCount == 0; }
+    size_t capacity() const { return mCapacity; }
+    /** @brief The heap memory used by the map, in bytes */
+    size_t memoryUsage() const { return mCapacity * sizeof(Entry); }
+    /** @brief Inserts the key with the specified value, if the key is not yet present.
+     * @returns The entry of the key, and whether it was inserted */
+    std::pair<Entry*, bool> emplace(uint64_t key, const V& val)
+    {
+        if (!key)
+            throw std::invalid_argument("IdHashMap: the key value 0 is reserved and can't be stored");
+        //keep the load factor at most 3/4
+        if ((mCount + 1) * 4 > mCapacity * 3)
+            rehash(mCapacity ? mCapacity * 2 : (size_t)kMinCapacity);
+        auto mask = mCapacity - 1;
+        for (auto i = slotOf(key, mask);; i = (i + 1) & mask)
+        {
+            auto& entry = mEntries[i];
+            if ((uint64_t)entry.first == key)
+                return std::make_pair(&entry, false);
+            if (isEmpty(entry))
+            {
+                entry.first = key;
+                entry.second = val;
+                mCount++;
+                return std::make_pair(&entry, true);
+            }
+        }
+    }
+    V& operator[](uint64_t key) { return emplace(key, V()).first->second; }
+    /** @brief Removes the key, if present. Uses backward-shift deletion, so
+     * there are no tombstones and lookups don't degrade over time.
+     * @returns Whether the key was present */
+    bool erase(uint64_t key)
+    {
+        Entry* entry = lookup(key);
+        if (!entry)
+            return false;
+        auto mask = mCapacity - 1;
+        size_t hole = entry - mEntries;
+        for (size_t i = (hole + 1) & mask; !isEmpty(mEntries[i]); i = (i + 1) & mask)
+        {
+            //move the entry into the hole, unless its home slot is cyclically in (hole, i]
+            auto home = slotOf(mEntries[i].first, mask);
+            if (((i - home) & mask) >= ((i - hole) & mask))
+            {
+                mEntries[hole] = mEntries[i];
+                hole = i;
+            }
+        }
+        mEntries[hole].first = K((uint64_t)0);
+        mEntries[hole].second = V();
+        mCount--;
+        return true;
+    }
+    void clear()
+    {
+        ::free(mEntries);
+        mEntries = nullptr;
+        mCapacity = mCount = 0;
+    }
+};
+}
+#endif
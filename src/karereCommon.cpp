@@ -7,6 +7,23 @@ namespace karere
 {
 const char* gDbSchemaVersionSuffix = "2";
 
+const char* const gDbMigrations[] =
+{
+    // 1: Covering index for the unread count query (getPeerMsgCountAfterIdx),
+    // and a partial index of the text messages, for getLastTextMessage
+    "CREATE INDEX IF NOT EXISTS history_idx_userid ON history(chatid, idx, userid);"
+    "CREATE INDEX IF NOT EXISTS history_text_idx ON history(chatid, idx) WHERE (type=1 or type >= 16);",
+    // 2: Incrementally maintained unread count. Null until calculated for the first time
+    "ALTER TABLE chats ADD COLUMN unread_count int;",
+    // 3: Recipient sets of the sending items, stored once per distinct set and
+    // referenced by sending.rcptset. sending.recipients is empty for such items
+    "CREATE TABLE recipient_sets(id integer primary key autoincrement, chatid int64 not null,"
+    "    hash int64 not null, users blob not null);"
+    "CREATE INDEX recipient_sets_hash ON recipient_sets(chatid, hash);"
+    "ALTER TABLE sending ADD COLUMN rcptset int;"
+};
+const size_t gDbMigrationCount = sizeof(gDbMigrations) / sizeof(gDbMigrations[0]);
+
 class Client;
 void globalInit(void(*postFunc)(void*), uint32_t options, const char* logPath, size_t logSize)
 {
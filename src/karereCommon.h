@@ -154,6 +154,13 @@ extern const char* gDbSchemaHash;
 // Defined in karereCommon.cpp
 extern const char* gDbSchemaVersionSuffix;
 
+// Incremental schema changes that can be applied to an existing db without
+// rebuilding it, i.e. adding indexes. Migration i brings the db to migration
+// version i+1. Incompatible changes should go to dbSchema.sql instead.
+// Defined in karereCommon.cpp
+extern const char* const gDbMigrations[];
+extern const size_t gDbMigrationCount;
+
 static inline int64_t timestampMs() { return services_get_time_ms(); }
 
 //logging stuff
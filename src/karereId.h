@@ -47,8 +47,9 @@ struct SetOfIds: public std::set<karere::Id>
     SetOfIds(const T& src) { load(src); }
     SetOfIds(){}
     SetOfIds(Base&& other): Base(std::move(other)){}
-    void save(Buffer& buf)
+    void save(Buffer& buf) const
     {
+        buf.reserveAppend(size()*8);
         for (auto id: *this)
             buf.append(id.val);
     }
@@ -0,0 +1,85 @@
+#ifndef STRONGVELOPE_CRYPTO_WORKER_POOL_H
+#define STRONGVELOPE_CRYPTO_WORKER_POOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+namespace strongvelope
+{
+/** @brief A fixed set of threads that run CPU-bound crypto jobs (signature
+ * verification and payload decryption) off the GUI thread.
+ * Jobs must not touch any chatd or karere state - they get their inputs by value,
+ * and post their results back to the GUI thread via \c karere::marshallCall().
+ * Anything that is reference-counted by non-atomic means (i.e. DeleteTrackable
+ * handles) must be created and destroyed on the GUI thread only.
+ */
+class CryptoWorkerPool
+{
+protected:
+    std::vector<std::thread> mThreads;
+    std::deque<std::function<void()>> mJobs;
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    bool mTerminating = false;
+    void threadFunc()
+    {
+        for (;;)
+        {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCond.wait(lock, [this]() { return mTerminating || !mJobs.empty(); });
+                if (mTerminating)
+                    return;
+                job = std::move(mJobs.front());
+                mJobs.pop_front();
+            }
+            job();
+        }
+    }
+public:
+    CryptoWorkerPool(unsigned threadCount)
+    {
+        for (unsigned i = 0; i < threadCount; i++)
+            mThreads.emplace_back(&CryptoWorkerPool::threadFunc, this);
+    }
+    CryptoWorkerPool(const CryptoWorkerPool&) = delete;
+    CryptoWorkerPool& operator=(const CryptoWorkerPool&) = delete;
+    ~CryptoWorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTerminating = true;
+        }
+        mCond.notify_all();
+        for (auto& thread: mThreads)
+            thread.join();
+    }
+    /** @brief The number of worker threads. If zero, no jobs should be posted */
+    unsigned threadCount() const { return (unsigned)mThreads.size(); }
+    /** @brief Queues a job to be run on one of the worker threads.
+     * Jobs are started in the order they are posted */
+    void post(std::function<void()>&& job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mJobs.push_back(std::move(job));
+        }
+        mCond.notify_one();
+    }
+    /** @brief The process-wide pool, with one thread less than the number of cores,
+     * leaving one for the GUI thread */
+    static CryptoWorkerPool& instance()
+    {
+        static CryptoWorkerPool pool(
+            std::max(std::thread::hardware_concurrency(), 1u) - 1);
+        return pool;
+    }
+};
+}
+#endif
@@ -84,43 +84,36 @@ static inline void aesCBCDecrypt(const StaticBuffer& cipherText,
 
 //CTR mode is used for message content
 
-//can't use binary buffers here, libsodium doesn't support them for CTR mode
-static inline std::string aesCTREncrypt(const std::string& text,
-                        const StaticBuffer& derivedkey, const StaticBuffer& iv)
-{
-    assert(iv.dataSize() == CryptoPP::AES::BLOCKSIZE);
-    assert(derivedkey.dataSize() == CryptoPP::AES::BLOCKSIZE);
-    CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption encryptor;
-    std::string cipher;
-    encryptor.SetKeyWithIV(derivedkey.ubuf(), derivedkey.dataSize(), iv.ubuf());
-    // The StreamTransformationFilter adds padding
-    //  as required. ECB and CBC Mode must be padded
-    //  to the block size of the cipher. CTR does not.
-    CryptoPP::StringSource s(text, true,
-        new CryptoPP::StreamTransformationFilter(encryptor,
-            new CryptoPP::StringSink(cipher)
-        ) // StreamTransformationFilter
-    ); // StringSource
-    return cipher;
-}
-
-static inline std::string aesCTRDecrypt(const std::string& ciphertext,
-                            const StaticBuffer& derivedkey, const StaticBuffer& iv)
+/** @brief AES-128-CTR with a fixed key. The key schedule is computed only once,
+ * and each message just sets its own IV, so one instance can process all messages
+ * that use the same key. In CTR mode encryption and decryption are the same
+ * operation, and the data is processed in place or straight into the
+ * destination buffer, without intermediate copies.
+ * @note Not thread-safe, every thread must use its own instance.
+ */
+class AesCtrCipher
 {
-    CryptoPP::CTR_Mode<CryptoPP::AES>::Decryption decryptor;
-    std::string text;
-    assert(iv.dataSize() == CryptoPP::AES::BLOCKSIZE);
-    assert(derivedkey.dataSize() == CryptoPP::AES::BLOCKSIZE);
-    decryptor.SetKeyWithIV(derivedkey.ubuf(), derivedkey.dataSize(), iv.ubuf());
-    // The StreamTransformationFilter adds padding
-    //  as required. ECB and CBC Mode must be padded
-    //  to the block size of the cipher. CTR does not.
-    CryptoPP::StringSource s(ciphertext, true,
-        new CryptoPP::StreamTransformationFilter(decryptor,
-            new CryptoPP::StringSink(text)
-        ) // StreamTransformationFilter
-    ); // StringSource
-    return text;
-}
+protected:
+    CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption mCipher;
+public:
+    AesCtrCipher(const StaticBuffer& key)
+    {
+        assert(key.dataSize() == CryptoPP::AES::BLOCKSIZE);
+        static const byte zeroIv[CryptoPP::AES::BLOCKSIZE] = {0};
+        mCipher.SetKeyWithIV(key.ubuf(), key.dataSize(), zeroIv);
+    }
+    /** @brief Starts processing a new message, with the specified IV */
+    void setIv(const StaticBuffer& iv)
+    {
+        assert(iv.dataSize() == CryptoPP::AES::BLOCKSIZE);
+        mCipher.Resynchronize(iv.ubuf(), (int)iv.dataSize());
+    }
+    /** @brief Processes the next \c len bytes of the current message.
+     * \c in and \c out may point to the same memory */
+    void process(const void* in, size_t len, void* out)
+    {
+        mCipher.ProcessData(static_cast<byte*>(out), static_cast<const byte*>(in), len);
+    }
+};
 
 }
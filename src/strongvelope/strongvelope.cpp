@@ -23,6 +23,8 @@
 #include "strongvelope.h"
 #include "cryptofunctions.h"
 #include <ctime>
+#include <algorithm>
+#include <atomic>
 #include "sodium.h"
 #include "tlvstore.h"
 #include <userAttrCache.h>
@@ -31,6 +33,8 @@
 #include <codecvt>
 #include <locale>
 #include <karereCommon.h>
+#include <gcmpp.h>
+#include "cryptoWorkerPool.h"
 
 namespace strongvelope
 {
@@ -43,8 +47,6 @@ const std::string PAIRWISE_KEY = "strongvelope pairwise key";
 const std::string PAIRWISE_KEY_WITH_SEP = PAIRWISE_KEY+(char)0x01u;
 const std::string SVCRYPTO_SIG = "strongvelopesig";
 const karere::Id API_USER("gTxFhlOd_LQ");
-void deriveNonceSecret(const StaticBuffer& masterNonce, const StaticBuffer &result,
-                       Id recipient=Id::null());
 
 
 const char* tlvTypeToString(uint8_t type)
@@ -72,7 +74,7 @@ uint32_t getKeyIdLength(uint32_t protocolVersion)
     return (protocolVersion == 1) ? 8 : 4;
 }
 
-EncryptedMessage::EncryptedMessage(const Message& msg, const StaticBuffer& aKey)
+EncryptedMessage::EncryptedMessage(const Message& msg, const SendKey& aKey)
 : key(aKey), backRefId(msg.backRefId)
 {
     assert(!key.empty());
@@ -97,8 +99,10 @@ EncryptedMessage::EncryptedMessage(const Message& msg, const StaticBuffer& aKey)
     {
         buf.append(msg);
     }
-    ciphertext = aesCTREncrypt(std::string(buf.buf(), buf.dataSize()),
-        key, derivedNonce);
+    auto& cipher = aKey.cipher();
+    cipher.setIv(derivedNonce);
+    ciphertext.resize(buf.dataSize());
+    cipher.process(buf.buf(), buf.dataSize(), &ciphertext[0]);
 }
 
 /**
@@ -107,7 +111,18 @@ EncryptedMessage::EncryptedMessage(const Message& msg, const StaticBuffer& aKey)
  * @param key Symmetric encryption key.
  * @param outMsg The message object to write the decrypted data to.
  */
-void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
+AesCtrCipher& SendKey::cipher() const
+{
+    assert(dataSize() == sizeof(mCipherKey));
+    if (!mCipher || memcmp(mCipherKey, buf(), sizeof(mCipherKey)))
+    {
+        mCipher.reset(new AesCtrCipher(*this));
+        memcpy(mCipherKey, buf(), sizeof(mCipherKey));
+    }
+    return *mCipher;
+}
+
+void ParsedMessage::symmetricDecrypt(const SendKey& key, Message& outMsg)
 {
     if (payload.empty())
     {
@@ -116,17 +131,83 @@ void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
     }
     Id chatid = mProtoHandler.chatid;
     STRONGVELOPE_LOG_DEBUG("Decrypting msg %s", outMsg.id().toString().c_str());
-    Key<32> derivedNonce;
+    decryptPayloadTo(key.cipher(), outMsg, &mProtoHandler.payloadIvCache());
+    outMsg.setEncrypted(0);
+}
+
+void ParsedMessage::payloadIv(Key<32>& iv, PayloadIvCache* ivCache) const
+{
+    if (ivCache && ivCache->get(nonce, iv))
+        return;
     // deriveNonceSecret() needs at least 32 bytes output buffer
-    deriveNonceSecret(nonce, derivedNonce);
-    derivedNonce.setDataSize(AES::BLOCKSIZE);
+    deriveNonceSecret(nonce, iv);
+    iv.setDataSize(AES::BLOCKSIZE);
     // For AES CRT mode, we take the first 12 bytes as the nonce,
     // and the remaining 4 bytes as the counter, which is initialized to zero
-    *reinterpret_cast<uint32_t*>(derivedNonce.buf()+SVCRYPTO_NONCE_SIZE) = 0;
-    std::string cleartext = aesCTRDecrypt(std::string(payload.buf(), payload.dataSize()),
-        key, derivedNonce);
-    parsePayload(StaticBuffer(cleartext, false), outMsg);
-    outMsg.setEncrypted(0);
+    *reinterpret_cast<uint32_t*>(iv.buf()+SVCRYPTO_NONCE_SIZE) = 0;
+    if (ivCache)
+        ivCache->put(nonce, iv);
+}
+
+void ParsedMessage::decryptPayload(AesCtrCipher& cipher, Buffer& output,
+    PayloadIvCache* ivCache) const
+{
+    Key<32> iv;
+    payloadIv(iv, ivCache);
+    cipher.setIv(iv);
+    output.clear();
+    output.reserve(payload.dataSize());
+    cipher.process(payload.buf(), payload.dataSize(), output.buf());
+    output.setDataSize(payload.dataSize());
+}
+
+void ParsedMessage::decryptPayloadTo(AesCtrCipher& cipher, Message& msg,
+    PayloadIvCache* ivCache)
+{
+    if (protocolVersion < 3)
+    {
+        // The backrefs are utf8-encoded, they can be parsed only from the whole cleartext
+        Buffer cleartext;
+        decryptPayload(cipher, cleartext, ivCache);
+        parsePayloadWithUtfBackrefs(cleartext, msg);
+        return;
+    }
+    // CTR is a stream cipher, so the header, the backrefs and the content are
+    // decrypted one after the other, each one directly to its destination.
+    // The layout is the same as parsed by parsePayload()
+    size_t size = payload.dataSize();
+    if (size < 10)
+        throw std::runtime_error("parsePayload: payload is less than backrefs minimum size");
+    Key<32> iv;
+    payloadIv(iv, ivCache);
+    cipher.setIv(iv);
+    char hdr[10];
+    cipher.process(payload.buf(), 10, hdr);
+    msg.backRefId = Buffer::alignSafeRead<uint64_t>(hdr);
+    uint16_t refsSize = Buffer::alignSafeRead<uint16_t>(hdr+8);
+    size_t binsize = 10+refsSize;
+    if (size < binsize)
+        throw std::runtime_error("parsePayload: Payload size "+std::to_string(size)+" is less than size of backrefs "+std::to_string(binsize));
+    assert(msg.backRefs.empty());
+    size_t refCount = refsSize / 8;
+    msg.backRefs.resize(refCount);
+    if (refCount)
+        cipher.process(payload.buf()+10, refCount*8, &msg.backRefs[0]);
+    if (refsSize % 8)
+    {
+        char partial[8]; //not a whole backref, skip it
+        cipher.process(payload.buf()+10+refCount*8, refsSize % 8, partial);
+    }
+    // The encrypted message is no longer needed, so the content is decrypted
+    // into its buffer
+    size_t contentSize = size-binsize;
+    msg.clear();
+    if (contentSize)
+    {
+        msg.reserve(contentSize);
+        cipher.process(payload.buf()+binsize, contentSize, msg.buf());
+        msg.setDataSize(contentSize);
+    }
 }
 
 /**
@@ -180,7 +261,7 @@ void ProtocolHandler::signMessage(const StaticBuffer& signedData,
         toSign.dataSize(), key.ubuf());
 }
 
-bool ParsedMessage::verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey)
+bool SignedMessage::verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey) const
 {
     assert(pubKey.dataSize() == 32);
     if (protocolVersion < 2)
@@ -236,7 +317,7 @@ void deriveSharedKey(const StaticBuffer& sharedSecret, SendKey& output)
 }
 
 ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& protoHandler)
-: mProtoHandler(protoHandler)
+: mProtoHandler(protoHandler), payload(nullptr, 0)
 {
     if(binaryMessage.empty())
     {
@@ -258,24 +339,28 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
         offset = 2;
         type = binaryMessage.read<uint8_t>(1);
     }
-    TlvParser tlv(binaryMessage, offset, isLegacy);
-    TlvRecord record(binaryMessage);
+    // The signed content is the only copy of the message data that we make -
+    // the records are parsed in place, and the payload is a slice of the signed content
+    size_t signedOffset = Buffer::kNotFound;
+    bool logRecords = krLoggerWouldLog(krLogChannel_strongvelope, krLogLevelDebug);
     std::string recordNames;
-    while (tlv.getRecord(record))
+    for (auto& record: TlvView(binaryMessage, offset, isLegacy))
     {
-        recordNames.append(tlvTypeToString(record.type))+=", ";
+        if (logRecords)
+            recordNames.append(tlvTypeToString(record.type))+=", ";
+        auto dataLen = record.value.dataSize();
         switch (record.type)
         {
             case TLV_TYPE_SIGNATURE:
             {
-                signature.assign(record.buf(), record.dataLen);
-                auto nextOffset = record.dataOffset+record.dataLen;
-                signedContent.assign(binaryMessage.buf()+nextOffset, binaryMessage.dataSize()-nextOffset);
+                signature.assign(record.value.buf(), dataLen);
+                signedOffset = record.dataOffset+dataLen;
+                signedContent.assign(binaryMessage.buf()+signedOffset, binaryMessage.dataSize()-signedOffset);
                 break;
             }
             case TLV_TYPE_NONCE:
             {
-                nonce.assign(record.buf(), record.dataLen);
+                nonce.assign(record.value.buf(), dataLen);
                 break;
             }
             case TLV_TYPE_MESSAGE_TYPE:
@@ -312,7 +397,7 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
             }
             case TLV_TYPE_KEYBLOB:
             {
-                encryptedKey.assign(record.buf(), record.dataLen);
+                encryptedKey.assign(record.value.buf(), dataLen);
                 break;
             }
             //legacy key stuff
@@ -320,14 +405,13 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
             {
                 if (target)
                     throw std::runtime_error("Already had one RECIPIENT tlv record");
-                record.validateDataLen(8);
-                target = binaryMessage.read<uint64_t>(record.dataOffset);
+                target = record.read<uint64_t>();
                 break;
             }
             case TLV_TYPE_KEYS:
             {
 //KEYS, not KEY, because these can be pairs of current+previous key, concatenated and encrypted together
-                encryptedKey.assign(record.buf(), record.dataLen);
+                encryptedKey.assign(record.value.buf(), dataLen);
                 break;
             }
             case TLV_TYPE_KEY_IDS:
@@ -335,24 +419,24 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
 //KEY_IDS, not KEY_ID, because the record may contain the previous keyid appended as well
                 // The key length can change depending on the version
                 uint32_t keyIdLength = getKeyIdLength(protocolVersion);
-                if (record.dataLen != keyIdLength && record.dataLen != keyIdLength*2)
+                if (dataLen != keyIdLength && dataLen != keyIdLength*2)
                     throw std::runtime_error("Key id length is not appropriate for this protocol version "+
                         std::to_string(protocolVersion)+
-                        ": expected "+std::to_string(keyIdLength)+" actual: "+std::to_string(record.dataLen));
+                        ": expected "+std::to_string(keyIdLength)+" actual: "+std::to_string(dataLen));
 //we don't do minimal record size checks, as read() does them
 //if we attempt to read past end of buffer, read() will throw
                 if (keyIdLength == 4)
                 {
-                    keyId = ntohl(binaryMessage.read<uint32_t>(record.dataOffset));
-                    prevKeyId = (record.dataLen > 4)
-                        ? ntohl(binaryMessage.read<uint32_t>(record.dataOffset+4))
+                    keyId = ntohl(record.value.read<uint32_t>(0));
+                    prevKeyId = (dataLen > 4)
+                        ? ntohl(record.value.read<uint32_t>(4))
                         : 0;
                 }
                 else if (keyIdLength == 8)
                 {
-                    keyId = be64toh(binaryMessage.read<uint64_t>(record.dataOffset));
-                    prevKeyId = (record.dataLen > 8)
-                        ? be64toh(binaryMessage.read<uint64_t>(record.dataOffset+8))
+                    keyId = be64toh(record.value.read<uint64_t>(0));
+                    prevKeyId = (dataLen > 8)
+                        ? be64toh(record.value.read<uint64_t>(8))
                         : 0;
                 }
                 break;
@@ -362,7 +446,15 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
             {
 //                if (type != SVCRYPTO_MSGTYPE_KEYED && type != SVCRYPTO_MSGTYPE_FOLLOWUP)
 //                    throw std::runtime_error("Payload record found in a non-regular message");
-                payload.assign(binaryMessage.buf()+record.dataOffset, record.dataLen);
+                if ((signedOffset != Buffer::kNotFound) && (record.dataOffset >= signedOffset))
+                {
+                    payload.assign(signedContent.buf()+(record.dataOffset-signedOffset), dataLen);
+                }
+                else
+                {
+                    mPayloadData.assign(record.value.buf(), dataLen);
+                    payload.assign(mPayloadData.buf(), dataLen);
+                }
                 break;
             }
             default:
@@ -450,13 +542,12 @@ ProtocolHandler::ProtocolHandler(karere::Id ownHandle,
     const StaticBuffer& privCu25519,
     const StaticBuffer& privEd25519,
     const StaticBuffer& privRsa,
-    karere::UserAttrCache& userAttrCache, sqlite3* db, Id aChatId)
+    karere::UserAttrProvider& userAttrCache, sqlite3* db, Id aChatId)
 : mOwnHandle(ownHandle), myPrivCu25519(privCu25519),
  myPrivEd25519(privEd25519), myPrivRsaKey(privRsa),
  mUserAttrCache(userAttrCache), mDb(db), chatid(aChatId)
 {
     getPubKeyFromPrivKey(myPrivEd25519, kKeyTypeEd25519, myPubEd25519);
-    loadKeysFromDb();
     auto var = getenv("KRCHAT_FORCE_RSA");
     if (var)
     {
@@ -465,39 +556,75 @@ ProtocolHandler::ProtocolHandler(karere::Id ownHandle,
     }
 }
 
-void ProtocolHandler::loadKeysFromDb()
+ProtocolHandler::KeyEntry& ProtocolHandler::keyEntry(UserKeyId ukid)
 {
-//    int oldest = time(NULL)-CHATD_MAX_EDIT_AGE-600;
-    SqliteStmt stmt(mDb, "select userid, keyid, key from sendkeys where chatid=?");
-    stmt << chatid;
-    while(stmt.step())
-    {
-        auto key = std::make_shared<SendKey>();
-        stmt.blobCol(2, *key);
-#ifndef NDEBUG
-        auto ret =
-#endif
-        mKeys.emplace(std::piecewise_construct,
-            std::forward_as_tuple(stmt.uint64Col(0), stmt.uint64Col(1)),
-            std::forward_as_tuple(key));
-        assert(ret.second);
+    auto it = mKeys.find(ukid);
+    if (it != mKeys.end())
+        return it->second;
+    auto& entry = mKeys[ukid];
+    // Uses the UNIQUE(chatid, userid, keyid) index of the table
+    SqliteStmt stmt(mDb, "select key from sendkeys where chatid=? and userid=? and keyid=?");
+    stmt << chatid << ukid.user << ukid.key;
+    if (stmt.step())
+    {
+        entry.key = std::make_shared<SendKey>();
+        stmt.blobCol(0, *entry.key);
+        STRONGVELOPE_LOG_DEBUG("Loaded key %" PRIu64 " of user %s from db",
+            ukid.key, ukid.user.toString().c_str());
+    }
+    return entry;
+}
+
+void ProtocolHandler::evictOldKeys()
+{
+    if (mKeys.size() <= kMaxCachedKeys)
+        return;
+    // Drop the least recently used quarter at once, so that this runs only
+    // once in a while
+    std::vector<uint64_t> uses;
+    uses.reserve(mKeys.size());
+    for (auto& item: mKeys)
+    {
+        if (item.second.key && !item.second.pms && (item.second.key != mCurrentKey))
+            uses.push_back(item.second.lastUse);
+    }
+    size_t count = std::min(uses.size(), mKeys.size()-kMaxCachedKeys*3/4);
+    if (!count)
+        return;
+    std::nth_element(uses.begin(), uses.begin()+(count-1), uses.end());
+    auto threshold = uses[count-1];
+    for (auto it = mKeys.begin(); it != mKeys.end();)
+    {
+        auto& entry = it->second;
+        if (entry.key && !entry.pms && (entry.key != mCurrentKey)
+            && (entry.lastUse <= threshold))
+        {
+            mKeys.erase(it++);
+        }
+        else
+        {
+            it++;
+        }
     }
-    STRONGVELOPE_LOG_DEBUG("(%" PRId64 "): Loaded %zu send keys from database", chatid, mKeys.size());
+    STRONGVELOPE_LOG_DEBUG("Dropped old send keys from RAM, %zu remaining", mKeys.size());
 }
 
 void ProtocolHandler::msgEncryptWithKey(Message& src, chatd::MsgCommand& dest,
-    const StaticBuffer& key)
+    const SendKey& key)
 {
     EncryptedMessage encryptedMessage(src, key);
     assert(!encryptedMessage.ciphertext.empty());
-    TlvWriter tlv(encryptedMessage.ciphertext.size()+128); //only signed content goes here
+    StaticBuffer ciphertext(encryptedMessage.ciphertext, false);
+    //only signed content goes here
+    TlvWriter tlv(TlvWriter::recordSize(encryptedMessage.nonce.dataSize())
+        + TlvWriter::recordSize(ciphertext.dataSize()));
     // Assemble message content.
     tlv.addRecord(TLV_TYPE_NONCE, encryptedMessage.nonce);
-    tlv.addRecord(TLV_TYPE_PAYLOAD, StaticBuffer(encryptedMessage.ciphertext, false));
+    tlv.addRecord(TLV_TYPE_PAYLOAD, ciphertext);
     Key<64> signature;
     signMessage(tlv, SVCRYPTO_PROTOCOL_VERSION, SVCRYPTO_MSGTYPE_FOLLOWUP,
                 encryptedMessage.key, signature);
-    TlvWriter sigTlv;
+    TlvWriter sigTlv(TlvWriter::recordSize(signature.dataSize()));
     sigTlv.addRecord(TLV_TYPE_SIGNATURE, signature);
 
     dest.reserve(tlv.dataSize()+sigTlv.dataSize()+2);
@@ -562,6 +689,28 @@ ProtocolHandler::encryptKeyTo(const std::shared_ptr<SendKey>& sendKey, karere::I
     });
 }
 
+/** Encrypts \c data with the RSA public key \c rsapub.
+ * @returns \c false if the public key can't be parsed */
+static bool rsaEncryptWithKey(const StaticBuffer& data, const StaticBuffer& rsapub,
+    Buffer& output)
+{
+    assert(data.dataSize() <= 512);
+    ::mega::AsymmCipher key;
+    auto ret = key.setkey(::mega::AsymmCipher::PUBKEY, rsapub.ubuf(), rsapub.dataSize());
+    if (!ret)
+        return false;
+
+    Buffer input;
+    //prepend 16-bit byte length prefix in network byte order
+    input.write<uint16_t>(0, htons(data.dataSize()));
+    input.append(data);
+    assert(input.dataSize() == data.dataSize()+2);
+    auto enclen = key.encrypt(input.ubuf(), input.dataSize(), (unsigned char*)output.writePtr(0, 512), 512);
+    assert(enclen <= 512);
+    output.setDataSize(enclen);
+    return true;
+}
+
 promise::Promise<std::shared_ptr<Buffer>>
 ProtocolHandler::rsaEncryptTo(const std::shared_ptr<StaticBuffer>& data, Id toUser)
 {
@@ -570,20 +719,9 @@ ProtocolHandler::rsaEncryptTo(const std::shared_ptr<StaticBuffer>& data, Id toUs
     .then([data, toUser](Buffer* rsapub) -> promise::Promise<std::shared_ptr<Buffer>>
     {
         assert(rsapub && !rsapub->empty());
-        ::mega::AsymmCipher key;
-        auto ret = key.setkey(::mega::AsymmCipher::PUBKEY, rsapub->ubuf(), rsapub->dataSize());
-        if (!ret)
-            return promise::Error("Error parsing fetched public RSA key of user "+toUser.toString(), EINVAL, SVCRYPTO_ERRTYPE);
-
         auto output = std::make_shared<Buffer>(512);
-        Buffer input;
-        //prepend 16-bit byte length prefix in network byte order
-        input.write<uint16_t>(0, htons(data->dataSize()));
-        input.append(*data);
-        assert(input.dataSize() == data->dataSize()+2);
-        auto enclen = key.encrypt(input.ubuf(), input.dataSize(), (unsigned char*)output->writePtr(0, 512), 512);
-        assert(enclen <= 512);
-        output->setDataSize(enclen);
+        if (!rsaEncryptWithKey(*data, *rsapub, *output))
+            return promise::Error("Error parsing fetched public RSA key of user "+toUser.toString(), EINVAL, SVCRYPTO_ERRTYPE);
         return output;
     });
 }
@@ -784,6 +922,112 @@ promise::Promise<Message*> ProtocolHandler::handleManagementMessage(
 }
 
 
+/** A group of consecutive messages from the same sender and with the same key,
+ * verified and decrypted on a crypto worker thread. The key and the signing
+ * pubkey are resolved once per group in advance on the GUI thread, and the worker
+ * only fills in the results. libsodium has no batch Ed25519 verification, so each
+ * signature is still verified on its own.
+ * The job is created and destroyed on the GUI thread only, as it holds
+ * non-thread-safe handles and promises
+ */
+struct ProtocolHandler::DecryptJob
+{
+    enum { kMaxMsgs = 32 }; //keep groups small enough to spread over the pool
+    struct Item
+    {
+        std::shared_ptr<ParsedMessage> parsedMsg;
+        // results, written by the worker
+        bool sigValid = false;
+        Buffer cleartext;
+        std::string error;
+        // set by msgDecrypt() if it is called before the job is done
+        Message* msg = nullptr;
+        Promise<Message*> pms;
+        Item(const std::shared_ptr<ParsedMessage>& aParsedMsg): parsedMsg(aParsedMsg) {}
+        // Runs on the GUI thread
+        void finish(Message& message, Promise<Message*>& outPms)
+        {
+            if (!error.empty())
+            {
+                outPms.reject(promise::Error(error));
+                return;
+            }
+            if (!sigValid)
+            {
+                outPms.reject(promise::Error("Signature invalid for message "+
+                    message.id().toString(), EINVAL, SVCRYPTO_ERRTYPE));
+                return;
+            }
+            if (parsedMsg->payload.empty())
+            {
+                message.clear();
+            }
+            else
+            {
+                try
+                {
+                    parsedMsg->parsePayload(cleartext, message);
+                }
+                catch(std::runtime_error& e)
+                {
+                    outPms.reject(promise::Error(e.what()));
+                    return;
+                }
+                message.setEncrypted(0);
+            }
+            outPms.resolve(&message);
+        }
+    };
+    std::vector<Item> items;
+    std::shared_ptr<SendKey> sendKey;
+    EcKey edKey;
+    karere::DeleteTrackable::Handle wptr;
+    std::atomic<bool> done;
+    DecryptJob(ProtocolHandler& handler, const std::shared_ptr<SendKey>& aSendKey,
+        const Buffer& aEdKey)
+    : sendKey(aSendKey), edKey(aEdKey), wptr(handler.weakHandle()), done(false)
+    {}
+    // Runs on a worker thread
+    void run()
+    {
+        AesCtrCipher cipher(*sendKey);
+        for (auto& item: items)
+        {
+            try
+            {
+                item.sigValid = item.parsedMsg->verifySignature(edKey, *sendKey);
+                if (!item.sigValid || item.parsedMsg->payload.empty())
+                    continue;
+                item.parsedMsg->decryptPayload(cipher, item.cleartext);
+            }
+            catch(std::exception& e)
+            {
+                item.error = e.what();
+            }
+        }
+        done.store(true, std::memory_order_release);
+    }
+    // Posted to the GUI thread by the worker. Takes over the worker's reference,
+    // so that the job is never released on the worker thread
+    struct Done
+    {
+        std::shared_ptr<DecryptJob> job;
+        Done(std::shared_ptr<DecryptJob>&& aJob): job(std::move(aJob)) {}
+        void operator()()
+        {
+            if (job->wptr.deleted())
+                return;
+            // Messages for which msgDecrypt() is not called yet will pick up
+            // their result from it
+            for (auto& item: job->items)
+            {
+                if (item.msg)
+                    item.finish(*item.msg, item.pms);
+            }
+        }
+    };
+};
+
 //We should have already received and decrypted the key in advance
 //(which is also async). This will have fetched the public Cu25519 key of
 //the peer (unless the key was encrypted using RSA), but we still need the
@@ -798,6 +1042,23 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
             message->setEncrypted(0);
             return Promise<Message*>(message);
         }
+        auto jobIt = mDecryptJobs.find(message->id());
+        if ((jobIt != mDecryptJobs.end()) && jobIt->second.matches(*message))
+        {
+            auto job = jobIt->second.job;
+            auto& item = job->items[jobIt->second.index];
+            mDecryptJobs.erase(jobIt);
+            message->type = item.parsedMsg->type;
+            if (job->done.load(std::memory_order_acquire))
+            {
+                Promise<Message*> pms;
+                item.finish(*message, pms);
+                return pms;
+            }
+            // the result will be applied when the worker posts it
+            item.msg = message;
+            return item.pms;
+        }
         auto parsedMsg = std::make_shared<ParsedMessage>(*message, *this);
         bool isLegacy = parsedMsg->protocolVersion <= 1;
         message->type = parsedMsg->type;
@@ -812,6 +1073,22 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
         else
         {
             keyid = message->keyid;
+            // Fast path - the key and the signing pubkey are already known, so
+            // verify and decrypt synchronously, without any intermediate promises
+            auto sendKey = cachedKey(UserKeyId(message->userid, keyid));
+            Buffer* edKeyBuf;
+            if (sendKey && (edKeyBuf = mUserAttrCache.getCachedAttr(parsedMsg->sender,
+                ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY)))
+            {
+                EcKey edKey(*edKeyBuf);
+                if (!parsedMsg->verifySignature(edKey, *sendKey))
+                {
+                    return promise::Error("Signature invalid for message "+
+                        message->id().toString(), EINVAL, SVCRYPTO_ERRTYPE);
+                }
+                parsedMsg->symmetricDecrypt(*sendKey, *message);
+                return message;
+            }
         }
 
         // Get sender key.
@@ -862,13 +1139,99 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
     }
 }
 
+void ProtocolHandler::preDecrypt(const std::vector<Message*>& msgs)
+{
+    // Start fetching the signing pubkeys of all senders in the batch that are
+    // not cached yet, rather than one by one as the messages get decrypted.
+    // The attribute cache makes a single request per user
+    for (auto message: msgs)
+    {
+        if ((message->userid != API_USER) && !mUserAttrCache.getCachedAttr(
+            message->userid, ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY))
+        {
+            mUserAttrCache.prefetchAttr(message->userid,
+                ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY);
+        }
+    }
+    // Results of earlier batches that msgDecrypt() didn't pick up, i.e. because the
+    // batch was cut short, would otherwise be kept as long as the handler. Dropping
+    // them is safe - msgDecrypt() then just takes the normal path
+    for (auto it = mDecryptJobs.begin(); it != mDecryptJobs.end();)
+    {
+        if (it->second.job->done.load(std::memory_order_acquire))
+            it = mDecryptJobs.erase(it);
+        else
+            it++;
+    }
+    auto& pool = CryptoWorkerPool::instance();
+    if (!pool.threadCount())
+        return;
+    // Only messages whose key and signing pubkey are already available are
+    // offloaded. The rest (and legacy and management messages) go through
+    // the normal async path in msgDecrypt(). Consecutive messages with the
+    // same sender and key are grouped in one job
+    std::shared_ptr<DecryptJob> job;
+    karere::Id jobSender;
+    uint32_t jobKeyid = CHATD_KEYID_INVALID;
+    auto postJob = [&pool, &job]()
+    {
+        if (!job)
+            return;
+        pool.post([job]() mutable
+        {
+            job->run();
+            marshallCall(DecryptJob::Done(std::move(job)));
+        });
+        job.reset();
+    };
+    for (auto message: msgs)
+    {
+        if (message->empty() || (message->userid == API_USER)
+         || (mDecryptJobs.find(message->id()) != mDecryptJobs.end()))
+            continue;
+        std::shared_ptr<ParsedMessage> parsedMsg;
+        try
+        {
+            parsedMsg = std::make_shared<ParsedMessage>(*message, *this);
+        }
+        catch(std::exception&)
+        {
+            continue; //msgDecrypt() will report the error
+        }
+        if (parsedMsg->protocolVersion <= 1)
+            continue;
+        if (job && ((parsedMsg->sender != jobSender) || (message->keyid != jobKeyid)
+            || (job->items.size() >= DecryptJob::kMaxMsgs)))
+        {
+            postJob();
+        }
+        if (!job)
+        {
+            auto sendKey = cachedKey(UserKeyId(message->userid, message->keyid));
+            if (!sendKey)
+                continue;
+            auto edKey = mUserAttrCache.getCachedAttr(parsedMsg->sender,
+                ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY);
+            if (!edKey)
+                continue;
+            job = std::make_shared<DecryptJob>(*this, sendKey, *edKey);
+            jobSender = parsedMsg->sender;
+            jobKeyid = message->keyid;
+        }
+        mDecryptJobs[message->id()] = DecryptJobRef{job, job->items.size(),
+            message, message->updated, message->dataSize()};
+        job->items.emplace_back(parsedMsg);
+    }
+    postJob();
+}
+
 Promise<void>
 ProtocolHandler::legacyExtractKeys(const std::shared_ptr<ParsedMessage>& parsedMsg)
 {
     if (parsedMsg->encryptedKey.empty())
         return promise::Error("legacyExtractKeys: No encrypted keys found in parsed message", EPROTO, SVCRYPTO_ERRTYPE);
 
-    auto& key1 = mKeys[UserKeyId(parsedMsg->sender, parsedMsg->keyId)];
+    auto& key1 = keyEntry(UserKeyId(parsedMsg->sender, parsedMsg->keyId));
     if (!key1.key)
     {
         if (!key1.pms)
@@ -876,7 +1239,7 @@ ProtocolHandler::legacyExtractKeys(const std::shared_ptr<ParsedMessage>& parsedM
     }
     if (parsedMsg->prevKeyId)
     {
-        auto& key2 = mKeys[UserKeyId(parsedMsg->sender, parsedMsg->prevKeyId)];
+        auto& key2 = keyEntry(UserKeyId(parsedMsg->sender, parsedMsg->prevKeyId));
         if (!key2.key)
         {
             if (!key2.pms)
@@ -910,7 +1273,7 @@ void ProtocolHandler::onKeyReceived(uint32_t keyid, Id sender, Id receiver,
         addDecryptedKey(UserKeyId(sender, keyid), pms.value());
         return;
     }
-    auto& entry = mKeys[UserKeyId(sender, keyid)];
+    auto& entry = keyEntry(UserKeyId(sender, keyid));
     STRONGVELOPE_LOG_DEBUG("onKeyReceived: Created a key entry with promise for key %d of user %s", keyid, sender.toString().c_str());
     if (entry.pms)
     {
@@ -943,7 +1306,8 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
 {
     assert(key->dataSize() == SVCRYPTO_KEY_SIZE);
     STRONGVELOPE_LOG_DEBUG("Adding key %lld of user %s", ukid.key, ukid.user.toString().c_str());
-    auto& entry = mKeys[ukid];
+    auto& entry = keyEntry(ukid);
+    entry.lastUse = ++mKeyUseCounter;
     if (entry.key)
     {
         if (memcmp(entry.key->buf(), key->buf(), SVCRYPTO_KEY_SIZE))
@@ -970,40 +1334,43 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
         entry.pms->resolve(entry.key);
         entry.pms.reset();
     }
+    evictOldKeys();
 }
-promise::Promise<std::shared_ptr<SendKey>>
-ProtocolHandler::getKey(UserKeyId ukid, bool legacy)
+std::shared_ptr<SendKey> ProtocolHandler::cachedKey(UserKeyId ukid)
 {
-    auto kit = mKeys.find(ukid);
-    if (kit == mKeys.end())
+    auto& entry = keyEntry(ukid);
+    if (!entry.key)
     {
-        if (legacy)
-        {
-            auto& key = mKeys[ukid];
-            key.pms.reset(new Promise<std::shared_ptr<SendKey>>);
-            return *key.pms;
-        }
-        else
-        {
-            return promise::Error("Key with id "+std::to_string(ukid.key)+
-            " from user "+ukid.user.toString()+" not found", SVCRYPTO_ENOKEY, SVCRYPTO_ERRTYPE);
-        }
+        if (!entry.pms)
+            mKeys.erase(ukid); //don't keep the empty entry created by keyEntry()
+        return nullptr;
     }
-    auto& entry = kit->second;
+    entry.lastUse = ++mKeyUseCounter;
     auto key = entry.key;
+    evictOldKeys();
+    return key;
+}
+
+promise::Promise<std::shared_ptr<SendKey>>
+ProtocolHandler::getKey(UserKeyId ukid, bool legacy)
+{
+    auto key = cachedKey(ukid);
     if (key)
-    {
         return key;
-    }
-    else if (entry.pms)
+    auto it = mKeys.find(ukid);
+    if (it != mKeys.end())
     {
-        return (*entry.pms);
+        assert(it->second.pms);
+        return *it->second.pms;
     }
-    else
+    if (legacy)
     {
-        assert(false && "Key found but no promise not key member are set");
-        return std::shared_ptr<SendKey>(); //return something, just to mute the gcc warning
+        auto& entry = mKeys[ukid];
+        entry.pms.reset(new Promise<std::shared_ptr<SendKey>>);
+        return *entry.pms;
     }
+    return promise::Error("Key with id "+std::to_string(ukid.key)+
+        " from user "+ukid.user.toString()+" not found", SVCRYPTO_ENOKEY, SVCRYPTO_ERRTYPE);
 }
 
 void ProtocolHandler::onKeyConfirmed(uint32_t keyxid, uint32_t keyid)
@@ -1020,9 +1387,149 @@ void ProtocolHandler::onKeyConfirmed(uint32_t keyxid, uint32_t keyid)
     addDecryptedKey(userKeyId, mCurrentKey);
 }
 
+/** A send key, and its encrypted copies for the participants it was prepared for.
+ * The x25519 part of the encryption runs on a crypto worker thread, see
+ * \c prepareSendKey(). The object is released only on the GUI thread, as it
+ * holds a DeleteTrackable handle
+ */
+struct ProtocolHandler::PreparedKey
+{
+    struct Recipient
+    {
+        karere::Id user;
+        Buffer cuPubKey; //empty if the key is encrypted with RSA
+        Buffer encryptedKey;
+        Recipient(karere::Id aUser): user(aUser) {}
+    };
+    ProtocolHandler& handler;
+    karere::DeleteTrackable::Handle wptr;
+    std::shared_ptr<SendKey> key;
+    karere::SetOfIds users;
+    EcKey privCu25519;
+    std::vector<Recipient> recipients;
+    bool ready = false;
+    PreparedKey(ProtocolHandler& aHandler)
+    : handler(aHandler), wptr(aHandler.weakHandle()),
+      key(std::make_shared<SendKey>()), privCu25519(aHandler.myPrivCu25519)
+    {
+        randombytes_buf(key->ubuf(), key->dataSize());
+    }
+    // Doesn't access any shared state, can run on a worker thread
+    void ecEncrypt()
+    {
+        for (auto& rcpt: recipients)
+        {
+            if (rcpt.cuPubKey.empty())
+                continue;
+            Key<crypto_scalarmult_BYTES> sharedSecret;
+            sharedSecret.setDataSize(crypto_scalarmult_BYTES);
+            auto ignore = crypto_scalarmult(sharedSecret.ubuf(), privCu25519.ubuf(), rcpt.cuPubKey.ubuf());
+            (void)ignore;
+            SendKey symkey;
+            deriveSharedKey(sharedSecret, symkey);
+            rcpt.encryptedKey.reserve(AES::BLOCKSIZE);
+            rcpt.encryptedKey.setDataSize(AES::BLOCKSIZE);
+            aesECBEncrypt(*key, symkey, rcpt.encryptedKey);
+        }
+    }
+    bool isFor(const karere::SetOfIds& aUsers) const
+    {
+        return ready && (users == aUsers);
+    }
+    // Posted to the GUI thread by the worker, takes over its reference
+    struct Done
+    {
+        std::shared_ptr<PreparedKey> prep;
+        Done(std::shared_ptr<PreparedKey>&& aPrep): prep(std::move(aPrep)) {}
+        void operator()()
+        {
+            if (prep->wptr.deleted() || (prep->handler.mPreparedKey != prep))
+                return; //participants changed meanwhile, or the handler was deleted
+            prep->ready = true;
+        }
+    };
+};
+
+void ProtocolHandler::schedulePrepareSendKey()
+{
+    mPreparedKey.reset();
+    if (mKeyPrepScheduled)
+        return;
+    mKeyPrepScheduled = true;
+    auto wptr = weakHandle();
+    marshallCall([this, wptr]()
+    {
+        if (wptr.deleted())
+            return;
+        mKeyPrepScheduled = false;
+        prepareSendKey();
+    });
+}
+
+void ProtocolHandler::prepareSendKey()
+{
+    mPreparedKey.reset();
+    if ((mCurrentKey && !mParticipantsChanged) || !mParticipants || mParticipants->empty())
+        return;
+    auto prep = std::make_shared<PreparedKey>(*this);
+    prep->users = *mParticipants;
+    prep->recipients.reserve(prep->users.size());
+    for (auto user: prep->users)
+    {
+        prep->recipients.emplace_back(user);
+        auto& rcpt = prep->recipients.back();
+        auto cuKey = mForceRsa ? nullptr
+            : mUserAttrCache.getCachedAttr(user, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY);
+        if (cuKey && !cuKey->empty())
+        {
+            rcpt.cuPubKey.assign(cuKey->buf(), cuKey->dataSize());
+            continue;
+        }
+        // The mega RSA implementation uses the SDK's global RNG, so it's not
+        // run on a worker thread
+        auto rsaKey = mUserAttrCache.getCachedAttr(user, USER_ATTR_RSA_PUBKEY);
+        if (!rsaKey || rsaKey->empty() || !rsaEncryptWithKey(*prep->key, *rsaKey, rcpt.encryptedKey))
+        {
+            STRONGVELOPE_LOG_DEBUG("Can't prepare send key in advance, no cached pubkey for user %s", user.toString().c_str());
+            return;
+        }
+    }
+    mPreparedKey = prep;
+    auto& pool = CryptoWorkerPool::instance();
+    if (!pool.threadCount())
+    {
+        prep->ecEncrypt();
+        prep->ready = true;
+        return;
+    }
+    pool.post([prep]() mutable
+    {
+        prep->ecEncrypt();
+        marshallCall(PreparedKey::Done(std::move(prep)));
+    });
+}
+
 promise::Promise<std::pair<KeyCommand*, std::shared_ptr<SendKey>>>
 ProtocolHandler::updateSenderKey()
 {
+    assert(mParticipants && !mParticipants->empty());
+    if (mPreparedKey && mPreparedKey->isFor(*mParticipants))
+    {
+        auto prep = std::move(mPreparedKey);
+        mCurrentKeyId = CHATD_KEYID_UNCONFIRMED;
+        mCurrentKey = prep->key;
+        mParticipantsChanged = false;
+        auto keyCmd = new KeyCommand(Id::null(), CHATD_KEYID_UNCONFIRMED,
+            KeyCommand::sizeFor(prep->recipients.size(), AES::BLOCKSIZE));
+        for (auto& rcpt: prep->recipients)
+        {
+            assert(!rcpt.encryptedKey.empty());
+            keyCmd->addKey(rcpt.user, rcpt.encryptedKey.buf(), rcpt.encryptedKey.dataSize());
+        }
+        mUnconfirmedKeyCmd.reset(keyCmd);
+        return std::make_pair(keyCmd, mCurrentKey);
+    }
+    mPreparedKey.reset();
     mCurrentKeyId = CHATD_KEYID_UNCONFIRMED;
     mUnconfirmedKeyCmd.reset();
     mCurrentKey.reset(new SendKey);
@@ -1050,12 +1557,14 @@ ProtocolHandler::encryptKeyToAllParticipants(const std::shared_ptr<SendKey>& key
 {
     // Users and send key may change while we are getting pubkeys of current
     // users, so make a snapshot
-    auto keyCmd = new KeyCommand(Id::null());
     SetOfIds users = *mParticipants;
     if (extraUser)
     {
         users.insert(extraUser);
     }
+    //x25519-encrypted keys are one AES block. RSA fallbacks are bigger and grow the buffer
+    auto keyCmd = new KeyCommand(Id::null(), CHATD_KEYID_UNCONFIRMED,
+        KeyCommand::sizeFor(users.size(), AES::BLOCKSIZE));
     std::vector<Promise<void>> promises;
     promises.reserve(users.size());
 
@@ -1152,16 +1661,21 @@ ParsedMessage::decryptChatTitle(chatd::Message* msg)
     });
 }
 
+// chatd calls these only while online. The next message will need a new key,
+// so prepare it in advance. This is not done on setUsers(), which is called for
+// every chat on startup and on every (re)join, including chats that never send
 void ProtocolHandler::onUserJoin(Id userid)
 {
     mParticipantsChanged = true;
     resetSendKey(); //just in case
+    schedulePrepareSendKey();
 }
 
 void ProtocolHandler::onUserLeave(Id userid)
 {
     mParticipantsChanged = true;
     resetSendKey(); //just in case
+    schedulePrepareSendKey();
 }
 
 void ProtocolHandler::resetSendKey()
@@ -1180,9 +1694,9 @@ void ProtocolHandler::setUsers(karere::SetOfIds* users)
     //pre-fetch user attributes
     for (auto userid: *users)
     {
-        mUserAttrCache.getAttr(userid, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY, nullptr, nullptr);
-        mUserAttrCache.getAttr(userid, ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY, nullptr, nullptr);
-        mUserAttrCache.getAttr(userid, USER_ATTR_RSA_PUBKEY, nullptr, nullptr);
+        mUserAttrCache.prefetchAttr(userid, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY);
+        mUserAttrCache.prefetchAttr(userid, ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY);
+        mUserAttrCache.prefetchAttr(userid, USER_ATTR_RSA_PUBKEY);
     }
 }
 
@@ -1191,15 +1705,13 @@ bool ProtocolHandler::handleLegacyKeys(chatd::Message& msg)
     auto protoVer = msg.read<uint8_t>(0);
     if (protoVer > 1)
         return false;
-    TlvParser tlv(msg, 1, true);
-    TlvRecord record(msg);
-    while (tlv.getRecord(record))
+    for (auto& record: TlvView(msg, 1, true))
     {
         if (record.type == TLV_TYPE_MESSAGE_TYPE)
         {
-            if (record.dataLen != 1)
+            if (record.value.dataSize() != 1)
                 throw std::runtime_error("TLV message type record is not 1 byte");
-            uint8_t type = msg.read<uint8_t>(record.dataOffset);
+            uint8_t type = record.value.read<uint8_t>(0);
             if (type != SVCRYPTO_MSGTYPE_KEYED)
                 return false;
             auto parsed = std::make_shared<ParsedMessage>(msg, *this);
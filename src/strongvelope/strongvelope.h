@@ -9,6 +9,7 @@
 #define STRONGVELOPE_H_
 #include <vector>
 #include <map>
+#include <memory>
 #include <string>
 #include <assert.h>
 #include <iostream>
@@ -45,7 +46,7 @@
 //constant names.
 namespace karere
 {
-    class UserAttrCache;
+    class UserAttrProvider;
 }
 struct sqlite3;
 
@@ -158,21 +159,60 @@ public:
         assign(data, len);
     }
 };
-typedef Key<16> SendKey;
 typedef Key<32> EcKey;
 
+class AesCtrCipher;
+/** @brief A symmetric message key. Keeps the expanded AES key schedule, so that
+ * it is computed once per key, rather than for every message encrypted or
+ * decrypted with the key */
+class SendKey: public Key<16>
+{
+protected:
+    //shared_ptr, as unlike unique_ptr it can be destroyed where AesCtrCipher is incomplete
+    mutable std::shared_ptr<AesCtrCipher> mCipher;
+    mutable char mCipherKey[16]; //the key data that mCipher was created with
+public:
+    using Key<16>::Key;
+    SendKey() {}
+    SendKey(const SendKey& other): Key<16>(static_cast<const StaticBuffer&>(other)) {}
+    SendKey& operator=(const SendKey& other)
+    {
+        assign(other.buf(), other.dataSize());
+        return *this;
+    }
+    /** @brief The AES-CTR cipher with this key. It is re-created if the key data
+     * has changed since the last call.
+     * @note As the cipher is stateful, this must be used only from the GUI thread */
+    AesCtrCipher& cipher() const;
+};
+
+/** @brief Derives the 32-byte payload or per-recipient nonce from the master
+ * nonce of a message, see the definition for details */
+void deriveNonceSecret(const StaticBuffer& masterNonce, const StaticBuffer& result,
+                       karere::Id recipient=karere::Id::null());
+
 class ProtocolHandler;
+class PayloadIvCache;
+/** The signed part of a message, and its signature */
+struct SignedMessage
+{
+    uint8_t protocolVersion;
+    unsigned char type;
+    Buffer signedContent;
+    Buffer signature;
+    bool verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey) const;
+};
+
 /** Class to parse an encrypted message and store its attributes and content */
-struct ParsedMessage: public chatd::Message::ManagementInfo, public karere::DeleteTrackable
+struct ParsedMessage: public SignedMessage, public chatd::Message::ManagementInfo,
+                      public karere::DeleteTrackable
 {
     ProtocolHandler& mProtoHandler;
-    uint8_t protocolVersion;
     karere::Id sender;
     Key<32> nonce;
-    Buffer payload;
-    Buffer signedContent;
-    Buffer signature;
-    unsigned char type;
+    /** Points into \c signedContent, or into \c mPayloadData if the message
+     * has no signature before the payload */
+    StaticBuffer payload;
     chatd::BackRefId backRefId = 0;
     std::vector<chatd::BackRefId> backRefs;
     //legacy key stuff
@@ -180,10 +220,22 @@ struct ParsedMessage: public chatd::Message::ManagementInfo, public karere::Dele
     uint64_t prevKeyId;
     Buffer encryptedKey; //may contain also the prev key, concatenated
     ParsedMessage(const chatd::Message& src, ProtocolHandler& protoHandler);
-    bool verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey);
+    ParsedMessage(const ParsedMessage&) = delete; //payload points into our own buffers
     void parsePayload(const StaticBuffer& data, chatd::Message& msg);
     void parsePayloadWithUtfBackrefs(const StaticBuffer& data, chatd::Message& msg);
-    void symmetricDecrypt(const StaticBuffer& key, chatd::Message& outMsg);
+    void symmetricDecrypt(const SendKey& key, chatd::Message& outMsg);
+    /** @brief Decrypts the payload into \c output. Does not touch any
+     * shared state, so it can be called from a crypto worker thread */
+    void decryptPayload(AesCtrCipher& cipher, Buffer& output,
+        PayloadIvCache* ivCache=nullptr) const;
+    /** @brief Decrypts the payload and parses it straight into the message's
+     * backref fields and buffer */
+    void decryptPayloadTo(AesCtrCipher& cipher, chatd::Message& msg,
+        PayloadIvCache* ivCache=nullptr);
+protected:
+    Buffer mPayloadData;
+    void payloadIv(Key<32>& iv, PayloadIvCache* ivCache) const;
+public:
     promise::Promise<chatd::Message*> decryptChatTitle(chatd::Message* msg);
 };
 
@@ -215,7 +267,56 @@ struct EncryptedMessage
     SendKey key;
     chatd::BackRefId backRefId;
     Key<SVCRYPTO_NONCE_SIZE> nonce;
-    EncryptedMessage(const chatd::Message& msg, const StaticBuffer& aKey);
+    EncryptedMessage(const chatd::Message& msg, const SendKey& aKey);
+};
+
+/** @brief A small LRU cache of the payload IVs derived from message nonces.
+ * A message that is decrypted again, i.e. after a failed attempt or when
+ * it is received once more, then skips the HMAC-SHA256 of the derivation */
+class PayloadIvCache
+{
+public:
+    enum { kCapacity = 32 };
+protected:
+    struct Entry
+    {
+        char nonce[SVCRYPTO_NONCE_SIZE];
+        char iv[SVCRYPTO_IV_SIZE];
+        uint32_t lastUse = 0; //0 means the entry is empty
+    };
+    Entry mEntries[kCapacity];
+    uint32_t mUseCounter = 0;
+public:
+    bool get(const StaticBuffer& nonce, Key<32>& iv)
+    {
+        if (nonce.dataSize() != SVCRYPTO_NONCE_SIZE)
+            return false;
+        for (auto& entry: mEntries)
+        {
+            if (entry.lastUse && !memcmp(entry.nonce, nonce.buf(), SVCRYPTO_NONCE_SIZE))
+            {
+                entry.lastUse = ++mUseCounter;
+                iv.assign(entry.iv, SVCRYPTO_IV_SIZE);
+                return true;
+            }
+        }
+        return false;
+    }
+    void put(const StaticBuffer& nonce, const StaticBuffer& iv)
+    {
+        if (nonce.dataSize() != SVCRYPTO_NONCE_SIZE)
+            return;
+        assert(iv.dataSize() == SVCRYPTO_IV_SIZE);
+        auto lru = &mEntries[0];
+        for (auto& entry: mEntries)
+        {
+            if (entry.lastUse < lru->lastUse)
+                lru = &entry;
+        }
+        memcpy(lru->nonce, nonce.buf(), SVCRYPTO_NONCE_SIZE);
+        memcpy(lru->iv, iv.buf(), SVCRYPTO_IV_SIZE);
+        lru->lastUse = ++mUseCounter;
+    }
 };
 
 struct UserKeyId
@@ -243,7 +344,7 @@ protected:
     EcKey myPrivEd25519;
     EcKey myPubEd25519;
     Key<768> myPrivRsaKey;
-    karere::UserAttrCache& mUserAttrCache;
+    karere::UserAttrProvider& mUserAttrCache;
     uint32_t mCurrentKeyId = CHATD_KEYID_INVALID;
     sqlite3* mDb;
     std::shared_ptr<SendKey> mCurrentKey;
@@ -255,23 +356,68 @@ protected:
     {
         std::shared_ptr<SendKey> key;
         std::shared_ptr<promise::Promise<std::shared_ptr<SendKey>>> pms;
+        uint64_t lastUse = 0;
         KeyEntry(){}
         KeyEntry(const std::shared_ptr<SendKey>& aKey): key(aKey){}
     };
+    /** The keys are loaded from the db on demand, and the least recently used
+     * ones are dropped from RAM when there are more than \c kMaxCachedKeys.
+     * Only keys that are in the db are dropped, i.e. never ones that are
+     * still being decrypted */
+    enum { kMaxCachedKeys = 256 };
     std::map<UserKeyId, KeyEntry> mKeys;
+    uint64_t mKeyUseCounter = 0;
     karere::SetOfIds* mParticipants = nullptr;
     bool mParticipantsChanged = true;
     bool mIsDestroying = false;
+    /** Messages that are being verified and decrypted by the crypto worker pool,
+     * see \c preDecrypt(). Maps a msgid to its job and the message's index in it.
+     * The entry is removed by \c msgDecrypt(). Results that were not picked up
+     * are dropped by \c cancelPreDecrypt(), and by the next \c preDecrypt() */
+    struct DecryptJob;
+    struct DecryptJobRef
+    {
+        std::shared_ptr<DecryptJob> job;
+        size_t index;
+        /** The result is only used for the very message that was passed to
+         * \c preDecrypt(), with unchanged content. Another message with the same
+         * msgid, i.e. an edit of it, takes the normal path */
+        const chatd::Message* msg;
+        uint16_t updated;
+        size_t dataSize;
+        bool matches(const chatd::Message& message) const
+        {
+            return (&message == msg) && (message.updated == updated)
+                && (message.dataSize() == dataSize);
+        }
+    };
+    std::map<karere::Id, DecryptJobRef> mDecryptJobs;
+    PayloadIvCache mPayloadIvCache;
+    /** A send key that is generated and encrypted to the participants in advance,
+     * when users join or leave while online, so that the first message sent after
+     * that doesn't have to wait for it. See \c prepareSendKey() */
+    struct PreparedKey;
+    std::shared_ptr<PreparedKey> mPreparedKey;
+    bool mKeyPrepScheduled = false;
 public:
     karere::Id chatid;
     karere::Id ownHandle() const { return mOwnHandle; }
+    PayloadIvCache& payloadIvCache() { return mPayloadIvCache; }
     ProtocolHandler(karere::Id ownHandle, const StaticBuffer& PrivCu25519,
         const StaticBuffer& PrivEd25519,
-        const StaticBuffer& privRsa, karere::UserAttrCache& userAttrCache,
+        const StaticBuffer& privRsa, karere::UserAttrProvider& userAttrCache,
         sqlite3* db, karere::Id aChatId);
 protected:
-    void loadKeysFromDb();
+    /** @brief Returns the in-RAM entry of the key, loading the key from the db
+     * if it is not in RAM. If the key is not in the db either, the returned entry
+     * is empty */
+    KeyEntry& keyEntry(UserKeyId ukid);
+    void evictOldKeys();
     promise::Promise<std::shared_ptr<SendKey>> getKey(UserKeyId ukid, bool legacy=false);
+    /** @brief Returns the key if it is already decrypted, loading it from the db
+     * if necessary, or \c nullptr otherwise. Unlike \c getKey(), does not
+     * create any promise */
+    std::shared_ptr<SendKey> cachedKey(UserKeyId ukid);
     void addDecryptedKey(UserKeyId ukid, const std::shared_ptr<SendKey>& key);
         /**
          * Updates our own sender key. Done when a message is sent and users
@@ -280,6 +426,14 @@ protected:
          */
     promise::Promise<std::pair<chatd::KeyCommand*, std::shared_ptr<SendKey>>>
     updateSenderKey();
+    /** @brief Schedules \c prepareSendKey() to run once the current message is
+     * processed, so that a burst of participant changes results in a single key */
+    void schedulePrepareSendKey();
+    /** @brief Generates the next send key and encrypts it to the current
+     * participants - the RSA encryption on the GUI thread, and the x25519 ones on
+     * the crypto worker pool. Only done if all needed pubkeys are cached,
+     * otherwise the key is created on demand by \c updateSenderKey(), as usual */
+    void prepareSendKey();
 
         /**
          * @brief Signs a message using EdDSA with the Ed25519 key pair.
@@ -307,7 +461,7 @@ protected:
     encryptKeyToAllParticipants(const std::shared_ptr<SendKey>& key, uint64_t extraUser=0);
 
     void msgEncryptWithKey(chatd::Message &src, chatd::MsgCommand& dest,
-        const StaticBuffer& key);
+        const SendKey& key);
     promise::Promise<chatd::Message*> handleManagementMessage(
         const std::shared_ptr<ParsedMessage>& parsedMsg, chatd::Message* msg);
     chatd::Message* legacyMsgDecrypt(const std::shared_ptr<ParsedMessage>& parsedMsg,
@@ -329,6 +483,8 @@ public:
         promise::Promise<std::pair<chatd::MsgCommand*, chatd::KeyCommand*>>
             msgEncrypt(chatd::Message *message, chatd::MsgCommand* msgCmd);
         virtual promise::Promise<chatd::Message*> msgDecrypt(chatd::Message* message);
+        virtual void preDecrypt(const std::vector<chatd::Message*>& msgs);
+        virtual void cancelPreDecrypt() { mDecryptJobs.clear(); }
         virtual void onKeyReceived(uint32_t keyid, karere::Id sender,
             karere::Id receiver, const char* data, uint16_t dataLen);
         virtual void onKeyConfirmed(uint32_t keyxid, uint32_t keyid);
@@ -78,6 +78,86 @@ public:
         return true;
 }
 };
+/** @brief A TLV record, as a slice of the container it was parsed from - no data
+ * is copied. Valid as long as the container is not modified or freed.
+ */
+struct TlvSlice
+{
+    uint8_t type = 0;
+    StaticBuffer value; ///< Points into the container
+    size_t dataOffset = 0; ///< Offset of \c value inside the container
+    TlvSlice(): value(nullptr, 0) {}
+    void validateDataLen(size_t expected) const
+    {
+        if (value.dataSize() != expected)
+            throw std::runtime_error("parseMessageContent: Unexpected length of TLV record with type "+std::to_string(type)+ ": expected "+std::to_string(expected)+" actual: "+std::to_string(value.dataSize()));
+    }
+    template <class T>
+    T read() const { validateDataLen(sizeof(T)); return value.read<T>(0); }
+};
+
+/** @brief Iterates over the records of a TLV container without copying them,
+ * i.e. <tt>for (auto& rec: TlvView(msg, 2, false)) use(rec.type, rec.value);</tt>
+ * Unlike \c TlvParser, a record with the 'until end of container' length
+ * code (0xffff) is also returned, as the last one.
+ * Malformed containers cause a \c std::runtime_error while iterating.
+ */
+class TlvView
+{
+protected:
+    const StaticBuffer& mSource;
+    size_t mOffset;
+    bool mLegacyMode;
+public:
+    class iterator
+    {
+    protected:
+        const TlvView* mView;
+        size_t mNext;
+        TlvSlice mCurrent;
+        void parse()
+        {
+            auto& src = mView->mSource;
+            if (mNext >= src.dataSize())
+            {
+                mView = nullptr;
+                return;
+            }
+            size_t typeLen = mView->mLegacyMode ? 2 : 1;
+            mCurrent.type = src.read<uint8_t>(mNext);
+            mCurrent.dataOffset = mNext+typeLen+2;
+            uint16_t valueLen = ntohs(src.read<uint16_t>(mNext+typeLen));
+            size_t len;
+            if ((valueLen == 0xffff) && !mView->mLegacyMode)
+            {
+                len = src.dataSize() - mCurrent.dataOffset;
+            }
+            else
+            {
+                len = valueLen;
+                if (mCurrent.dataOffset+len > src.dataSize())
+                    throw std::runtime_error("TlvView: Corrupt data - record spans outside of physical buffer");
+            }
+            mCurrent.value = StaticBuffer(src.buf()+mCurrent.dataOffset, len);
+            mNext = mCurrent.dataOffset+len;
+        }
+    public:
+        iterator(const TlvView* view, size_t offset): mView(view), mNext(offset)
+        {
+            if (mView)
+                parse();
+        }
+        const TlvSlice& operator*() const { return mCurrent; }
+        const TlvSlice* operator->() const { return &mCurrent; }
+        iterator& operator++() { parse(); return *this; }
+        bool operator!=(const iterator& other) const { return mView != other.mView; }
+    };
+    TlvView(const StaticBuffer& source, size_t offset, bool legacyMode)
+    :mSource(source), mOffset(offset), mLegacyMode(legacyMode){}
+    iterator begin() const { return iterator(this, mOffset); }
+    iterator end() const { return iterator(nullptr, 0); }
+};
+
 class TlvWriter: public Buffer
 {
 protected:
@@ -86,6 +166,9 @@ protected:
 #endif
 public:
     explicit TlvWriter(size_t reserve=128): Buffer(reserve){}
+    /** @brief The encoded size of a record with a value of \c valueLen bytes.
+     * Summing these for all records gives the exact size to reserve */
+    static size_t recordSize(size_t valueLen) { return 3+valueLen; }
 
 /**
  * Generates a binary encoded TLV record from a key-value pair.
@@ -98,27 +181,31 @@ public:
 void addRecord(uint8_t type, const StaticBuffer& value)
 {
     assert(!mEnded);
-    append(type);
-    if (value.dataSize() >= 0xffff)
+    auto len = value.dataSize();
+    uint16_t lenCode;
+    if (len >= 0xffff)
     {
-        append<uint16_t>(0xffff);
-#ifdef NODEBUG
+        lenCode = 0xffff;
+#ifndef NDEBUG
         mEnded = true;
 #endif
     }
     else
     {
-        append<uint16_t>(htons(value.dataSize()));
+        lenCode = htons(len);
     }
-    append(value);
+    //single capacity check per record
+    auto ptr = appendPtr(recordSize(len));
+    ptr[0] = type;
+    memcpy(ptr+1, &lenCode, 2);
+    if (len)
+        memcpy(ptr+3, value.buf(), len);
 }
 
 template <typename T, typename=typename std::enable_if<std::is_pod<T>::value>::type>
 void addRecord(uint8_t type, T val)
 {
-    assert(!mEnded);
-    append(type);
-    append<uint16_t>(htons(sizeof(val))).append(val);
+    addRecord(type, StaticBuffer((const char*)&val, sizeof(val)));
 }
 };
 }
@@ -494,6 +494,14 @@ void UserAttrCache::onLogOut()
     mIsLoggedIn = false;
 }
 
+Buffer* UserAttrCache::getCachedAttr(uint64_t user, unsigned attrType) const
+{
+    auto it = find(UserAttrPair(user, attrType));
+    if (it == end() || it->second->pending == kCacheFetchNewPending)
+        return nullptr;
+    return it->second->data.get();
+}
+
 promise::Promise<Buffer*>
 UserAttrCache::getAttr(uint64_t user, unsigned attrType)
 {
@@ -117,11 +117,29 @@ struct UserAttrCacheItem
     void errorNoDb(int errCode);
     void notify();
 };
+/** @brief
+ * The attribute lookups that the crypto module needs. Implemented by
+ * \c UserAttrCache, and by stand-ins that serve attributes without a client,
+ * i.e. in the benchmarks
+ */
+class UserAttrProvider
+{
+public:
+    /** @brief Obtains the attribute, fetching it if it's not in the cache */
+    virtual promise::Promise<Buffer*> getAttr(uint64_t user, unsigned attrType) = 0;
+    /** @brief Returns the attribute if it's in the cache, \c nullptr otherwise */
+    virtual Buffer* getCachedAttr(uint64_t user, unsigned attrType) const = 0;
+    /** @brief Starts fetching the attribute if it's not in the cache, without
+     * waiting for it */
+    virtual void prefetchAttr(uint64_t user, unsigned attrType) = 0;
+    virtual ~UserAttrProvider() {}
+};
 /** @brief
  * User attribute cache, prividing notifications when an attribute is changed
  */
 class UserAttrCache: public std::map<UserAttrPair, std::shared_ptr<UserAttrCacheItem>>,
-                     public mega::MegaGlobalListener, public karere::DeleteTrackable
+                     public mega::MegaGlobalListener, public karere::DeleteTrackable,
+                     public UserAttrProvider
 {
 protected:
     Client& mClient;
@@ -173,7 +191,17 @@ public:
     /** @brief A promise-based version of \c getAttr. The request
      * is implicitly one-shot, as a promise can be resolved only once.
      */
-    promise::Promise<Buffer*> getAttr(uint64_t user, unsigned attrType);
+    virtual promise::Promise<Buffer*> getAttr(uint64_t user, unsigned attrType);
+    /** @brief Returns the attribute if it is already in the cache, without
+     * fetching it or registering a callback.
+     * @returns \c nullptr if the attribute is not in the cache, is still being
+     * fetched, or could not be fetched
+     */
+    virtual Buffer* getCachedAttr(uint64_t user, unsigned attrType) const;
+    virtual void prefetchAttr(uint64_t user, unsigned attrType)
+    {
+        getAttr(user, attrType, nullptr, nullptr);
+    }
     /** @brief Unregisters an attribute request/subsequent callbacks.
      * It can be a not-yet-fetched single shot request as well. Use this method
      * to unsubscribe from further calling the corresponding callback.
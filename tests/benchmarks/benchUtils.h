@@ -0,0 +1,97 @@
+#ifndef BENCH_UTILS_H
+#define BENCH_UTILS_H
+
+// Common helpers for the karere benchmarks - timing, a minimal app message
+// queue and machine-readable output (one JSON object per line on stdout)
+
+#include <chrono>
+#include <mutex>
+#include <deque>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gcm.h>
+
+namespace bench
+{
+class Timer
+{
+protected:
+    std::chrono::steady_clock::time_point mStart;
+public:
+    Timer(): mStart(std::chrono::steady_clock::now()) {}
+    void reset() { mStart = std::chrono::steady_clock::now(); }
+    double elapsedMs() const
+    {
+        return std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - mStart).count();
+    }
+};
+
+// The karere services post messages (i.e. timer callbacks) to the app's GUI thread.
+// The benchmarks don't run an event loop, so they process these explicitly, via
+// processMessages(), from the main thread.
+static inline std::mutex& msgQueueMutex()
+{
+    static std::mutex sMutex;
+    return sMutex;
+}
+
+static inline std::deque<void*>& msgQueue()
+{
+    static std::deque<void*> sQueue;
+    return sQueue;
+}
+
+static inline void postMessage(void* msg)
+{
+    std::lock_guard<std::mutex> lock(msgQueueMutex());
+    msgQueue().push_back(msg);
+}
+
+static inline void processMessages()
+{
+    std::deque<void*> msgs;
+    {
+        std::lock_guard<std::mutex> lock(msgQueueMutex());
+        msgs.swap(msgQueue());
+    }
+    for (auto msg: msgs)
+        megaProcessMessage(msg);
+}
+
+/** @brief Prints a single result as a JSON object on one line, for example:
+ * {"bench":"chatdDb","case":"group-commit","metric":"rate","value":12345.678,"unit":"msg/s","n":20000}
+ */
+static inline void report(const char* benchName, const std::string& caseName,
+    const char* metric, double value, const char* unit, unsigned long long n)
+{
+    printf("{\"bench\":\"%s\",\"case\":\"%s\",\"metric\":\"%s\",\"value\":%.3f,\"unit\":\"%s\",\"n\":%llu}\n",
+        benchName, caseName.c_str(), metric, value, unit, n);
+    fflush(stdout);
+}
+
+/** @brief Returns the integer value of a "--name value" command line option */
+static inline long argInt(int argc, char** argv, const char* name, long defVal)
+{
+    for (int i = 1; i < argc-1; i++)
+    {
+        if (strcmp(argv[i], name) == 0)
+            return strtol(argv[i+1], nullptr, 10);
+    }
+    return defVal;
+}
+
+/** @brief Returns the value of a "--name value" command line option */
+static inline const char* argStr(int argc, char** argv, const char* name, const char* defVal)
+{
+    for (int i = 1; i < argc-1; i++)
+    {
+        if (strcmp(argv[i], name) == 0)
+            return argv[i+1];
+    }
+    return defVal;
+}
+}
+#endif
@@ -0,0 +1,106 @@
+// Counts the heap allocations and measures the time of the Buffer work done per
+// received message - the message payload, its decrypted copy and the RECEIVED
+// command appended to the send batch - with the plain heap allocator and
+// heap-allocated commands (as before), and with the pooled allocator and
+// commands built in their inline buffer.
+// Usage: bufferAllocBench [--count N] [--window N]
+
+#include <chatdMsg.h>
+#include <buffer.h>
+#include <vector>
+#include <memory>
+#include <random>
+#include "benchUtils.h"
+
+using namespace chatd;
+
+// Plain malloc/realloc/free, counting the calls
+static uint64_t gHeapAllocs = 0;
+static char* countingAlloc(size_t& size)
+{
+    gHeapAllocs++;
+    return BufferAllocator::mallocAlloc(size);
+}
+static char* countingRealloc(char* ptr, size_t oldSize, size_t& newSize)
+{
+    gHeapAllocs++;
+    return BufferAllocator::mallocRealloc(ptr, oldSize, newSize);
+}
+
+static uint64_t heapAllocCount(bool pooled)
+{
+    return pooled ? BufferPool::stats().heapAllocs : gHeapAllocs;
+}
+
+static void runBench(const char* name, bool pooled, size_t count, size_t window,
+    const std::vector<Buffer>& payloads)
+{
+    BufferAllocator::current() = pooled
+        ? BufferAllocator::pooled()
+        : BufferAllocator{countingAlloc, countingRealloc, BufferAllocator::mallocFree};
+
+    karere::Id chatid((uint64_t)0x1234567890);
+    karere::Id userid((uint64_t)0x9876543210);
+    std::vector<std::unique_ptr<Message>> history(window);
+    Buffer sendBatch(4096);
+    size_t batchCount = 0;
+
+    auto allocsBefore = heapAllocCount(pooled);
+    bench::Timer timer;
+    for (size_t i = 0; i < count; i++)
+    {
+        auto& payload = payloads[i % payloads.size()];
+        karere::Id msgid((uint64_t)i+1);
+        //the received NEWMSG payload, as copied by MsgCommandView::toMessage()
+        std::unique_ptr<Message> msg(new Message(msgid, userid, 1000, 0,
+            payload.buf(), payload.dataSize()));
+        //the decrypted content, which replaces the payload
+        Buffer plaintext(payload.dataSize());
+        plaintext.append(payload.buf()+16, payload.dataSize()-16);
+        msg->takeFrom(std::move(plaintext));
+        //the RECEIVED command, appended to the send batch of the current tick
+        if (pooled)
+        {
+            auto cmd = Command(OP_RECEIVED) + chatid + msgid;
+            sendBatch.append(cmd);
+        }
+        else
+        {
+            Buffer cmd(64);
+            cmd.append<uint8_t>(OP_RECEIVED).append(chatid.val).append(msgid.val);
+            sendBatch.append(cmd);
+        }
+        if (++batchCount == 20)
+        {
+            sendBatch.clear();
+            batchCount = 0;
+        }
+        //the history window drops the oldest message
+        history[i % window] = std::move(msg);
+    }
+    double ms = timer.elapsedMs();
+    auto allocs = heapAllocCount(pooled) - allocsBefore;
+    history.clear();
+
+    bench::report("bufferAlloc", name, "heap_allocs", (double)allocs / count, "allocs/msg", count);
+    bench::report("bufferAlloc", name, "time", ms * 1000000.0 / count, "ns/msg", count);
+}
+
+int main(int argc, char** argv)
+{
+    size_t count = bench::argInt(argc, argv, "--count", 1000000);
+    size_t window = bench::argInt(argc, argv, "--window", 1000);
+    //typical text message sizes, including the strongvelope overhead
+    std::mt19937 rng(42);
+    std::vector<Buffer> payloads;
+    for (size_t i = 0; i < 256; i++)
+    {
+        size_t size = 100 + rng() % ((i % 16) ? 300 : 3000);
+        Buffer payload(size);
+        payload.appendFill(0x55, size);
+        payloads.push_back(std::move(payload));
+    }
+    runBench("heap", false, count, window, payloads);
+    runBench("pooled+inline", true, count, window, payloads);
+    return 0;
+}
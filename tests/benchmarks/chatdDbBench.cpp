@@ -0,0 +1,182 @@
+// Replays a synthetic chat history into the chatd sqlite db, to measure the
+// history ingest rate, and how the per-insert cost scales with history size.
+// Usage: chatdDbBench [--msgs N] [--scale-msgs N] [--db path]
+
+#include <chatd.h>
+#include <chatdDb.h>
+#include <chatdICrypto.h>
+#include <karereCommon.h>
+#include "benchUtils.h"
+#include <unistd.h>
+#include <functional>
+
+using namespace chatd;
+using namespace karere;
+
+class BenchCrypto: public ICrypto
+{
+public:
+    virtual void setUsers(karere::SetOfIds* users) {}
+    virtual void onKeyReceived(KeyId keyid, karere::Id sender, karere::Id receiver,
+        const char* keydata, uint16_t keylen) {}
+    virtual void onKeyConfirmed(KeyId keyxid, KeyId keyid) {}
+    virtual void resetSendKey() {}
+    virtual const chatd::KeyCommand* unconfirmedKeyCmd() const { return nullptr; }
+    virtual bool handleLegacyKeys(chatd::Message& msg) { return false; }
+    virtual void randomBytes(void* buf, size_t bufsize) const { memset(buf, 0, bufsize); }
+    virtual promise::Promise<std::shared_ptr<Buffer>>
+    encryptChatTitle(const std::string& data, uint64_t extraUser=0)
+    {
+        return std::make_shared<Buffer>(data.c_str(), data.size());
+    }
+    virtual promise::Promise<std::string>
+    decryptChatTitle(const Buffer& data)
+    {
+        return std::string(data.buf(), data.dataSize());
+    }
+};
+
+class BenchListener: public Listener
+{
+public:
+    sqlite3* mDb;
+    ChatdSqliteDb* mChatDb = nullptr;
+    BenchListener(sqlite3* db): mDb(db) {}
+    virtual void init(Chat& chat, DbInterface*& dbIntf)
+    {
+        mChatDb = new ChatdSqliteDb(chat, mDb);
+        dbIntf = mChatDb;
+    }
+    virtual void onOnlineStateChange(ChatState state) {}
+};
+
+static sqlite3* openBenchDb(const std::string& path, Id chatid, bool migrate)
+{
+    unlink(path.c_str());
+    sqlite3* db;
+    if (sqlite3_open(path.c_str(), &db) != SQLITE_OK)
+        throw std::runtime_error("Can't open benchmark db "+path);
+    sqliteSimpleQuery(db, gDbSchema);
+    sqliteQuery(db, "insert into chats(chatid, shard, own_priv) values(?,0,3)", chatid);
+    sqliteSimpleQuery(db, "BEGIN TRANSACTION");
+    if (migrate)
+        sqliteApplyMigrations(db, gDbMigrations, gDbMigrationCount);
+    return db;
+}
+
+// Returns the time taken to add msgCount messages to the history of a single chat.
+// If sliceTimes is given, the time of each consecutive sliceSize inserts is appended to it.
+// If afterReplay is given, it is called with the chat's db interface once all messages are added
+static double replayHistory(const std::string& dbPath, size_t msgCount,
+    unsigned maxPendingWrites, uint64_t& commitCount,
+    std::vector<double>* sliceTimes=nullptr, size_t sliceSize=10000,
+    bool migrate=true, const std::function<void(ChatdSqliteDb&)>& afterReplay=nullptr)
+{
+    Id myHandle(0x1234);
+    Id chatid(0x5678);
+    Id peer(0x9abc);
+    sqlite3* db = openBenchDb(dbPath, chatid, migrate);
+    SqliteGroupCommit::get(db).maxPendingWrites = maxPendingWrites;
+    double elapsed;
+    {
+        chatd::Client client(myHandle);
+        BenchListener listener(db);
+        SetOfIds users;
+        users.insert(myHandle);
+        users.insert(peer);
+        client.createChat(chatid, 0, "", &listener, users, new BenchCrypto, 0);
+
+        std::string payload(120, 'x');
+        bench::Timer timer;
+        bench::Timer sliceTimer;
+        for (size_t i = 0; i < msgCount; i++)
+        {
+            if (sliceTimes && i && (i % sliceSize == 0))
+            {
+                sliceTimes->push_back(sliceTimer.elapsedMs());
+                sliceTimer.reset();
+            }
+            Message msg(Id(i+1), (i & 1) ? myHandle : peer, 1500000000+i, 0,
+                payload.c_str(), payload.size(), false, 0, Message::kMsgNormal);
+            listener.mChatDb->addMsgToHistory(msg, (Idx)i);
+            if ((i % 50) == 49)
+                listener.mChatDb->setLastSeen(msg.id());
+            if ((i % 256) == 0)
+                bench::processMessages();
+        }
+        SqliteGroupCommit::get(db).flush();
+        elapsed = timer.elapsedMs();
+        if (sliceTimes && (msgCount % sliceSize == 0))
+            sliceTimes->push_back(sliceTimer.elapsedMs());
+        commitCount = SqliteGroupCommit::get(db).commitCount();
+        if (afterReplay)
+            afterReplay(*listener.mChatDb);
+    }
+    sqliteCloseDb(db);
+    unlink(dbPath.c_str());
+    return elapsed;
+}
+
+int main(int argc, char** argv)
+{
+    size_t msgCount = bench::argInt(argc, argv, "--msgs", 20000);
+    size_t scaleMsgCount = bench::argInt(argc, argv, "--scale-msgs", 100000);
+    size_t queryMsgCount = bench::argInt(argc, argv, "--query-msgs", 50000);
+    std::string dbPath = bench::argStr(argc, argv, "--db", "chatdDbBench.sqlite");
+    karere::globalInit(bench::postMessage, 0, nullptr, 0);
+
+    struct { const char* name; unsigned maxPending; } cases[] =
+    {
+        { "commit-per-write", 1 },
+        { "group-commit", SqliteGroupCommit::kDefaultMaxPendingWrites }
+    };
+    for (auto& c: cases)
+    {
+        uint64_t commits = 0;
+        double ms = replayHistory(dbPath, msgCount, c.maxPending, commits);
+        bench::report("chatdDb", c.name, "rate", msgCount * 1000.0 / ms, "msg/s", msgCount);
+        bench::report("chatdDb", c.name, "commits", commits, "count", msgCount);
+    }
+
+    // Per-insert cost must not grow with the size of the history
+    const size_t sliceSize = 10000;
+    std::vector<double> slices;
+    uint64_t commits = 0;
+    replayHistory(dbPath, scaleMsgCount, SqliteGroupCommit::kDefaultMaxPendingWrites,
+        commits, &slices, sliceSize);
+    for (size_t i = 0; i < slices.size(); i++)
+    {
+        bench::report("chatdDb", "single-chat-"+std::to_string((i+1)*sliceSize),
+            "insert_cost", slices[i] * 1000.0 / sliceSize, "us/msg", sliceSize);
+    }
+    if (slices.size() > 1)
+    {
+        bench::report("chatdDb", "single-chat", "last_to_first_slice",
+            slices.back() / slices.front(), "ratio", scaleMsgCount);
+    }
+
+    // Queries run when a chat is opened, with and without the schema migrations' indexes
+    const int queryRuns = 20;
+    for (int migrate = 0; migrate < 2; migrate++)
+    {
+        std::string name = migrate ? "indexed" : "unindexed";
+        replayHistory(dbPath, queryMsgCount, SqliteGroupCommit::kDefaultMaxPendingWrites,
+            commits, nullptr, sliceSize, migrate, [&](ChatdSqliteDb& chatDb)
+        {
+            bench::Timer timer;
+            for (int i = 0; i < queryRuns; i++)
+                chatDb.getPeerMsgCountAfterIdx(queryMsgCount / 10);
+            bench::report("chatdDb", "unread-count-"+name, "query_time",
+                timer.elapsedMs() / queryRuns, "ms", queryMsgCount);
+
+            timer.reset();
+            LastTextMsgState lastText;
+            for (int i = 0; i < queryRuns; i++)
+                chatDb.getLastTextMessage(queryMsgCount-1, lastText);
+            bench::report("chatdDb", "last-text-msg-"+name, "query_time",
+                timer.elapsedMs() / queryRuns, "ms", queryMsgCount);
+        });
+    }
+    karere::globalCleanup();
+    return 0;
+}
@@ -0,0 +1,97 @@
+// Compares karere::IdHashMap with std::map as a msgid -> idx index:
+// insert time, lookup time and memory use, at 10k, 100k and 1M messages.
+// Usage: idHashMapBench [--lookups N]
+
+#include <idHashMap.h>
+#include <karereId.h>
+#include <map>
+#include <vector>
+#include <random>
+#include "benchUtils.h"
+
+typedef int32_t Idx;
+
+// Counts the bytes allocated by std::map, to compare memory use
+static size_t gMapAllocBytes = 0;
+template <class T>
+struct CountingAllocator
+{
+    typedef T value_type;
+    CountingAllocator() {}
+    template <class U>
+    CountingAllocator(const CountingAllocator<U>&) {}
+    T* allocate(size_t n)
+    {
+        gMapAllocBytes += n * sizeof(T);
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t n)
+    {
+        gMapAllocBytes -= n * sizeof(T);
+        ::operator delete(p);
+    }
+};
+template <class T, class U>
+bool operator==(const CountingAllocator<T>&, const CountingAllocator<U>&) { return true; }
+template <class T, class U>
+bool operator!=(const CountingAllocator<T>&, const CountingAllocator<U>&) { return false; }
+
+typedef std::map<karere::Id, Idx, std::less<karere::Id>,
+    CountingAllocator<std::pair<const karere::Id, Idx>>> StdMap;
+typedef karere::IdHashMap<karere::Id, Idx> HashMap;
+
+static volatile Idx gSink;
+
+template <class M>
+static void runBench(const char* name, M& map, const std::vector<uint64_t>& ids,
+    const std::vector<uint64_t>& probes, size_t (*memUsage)(const M&))
+{
+    std::string caseName = std::string(name)+"-"+std::to_string(ids.size());
+    bench::Timer timer;
+    Idx idx = 0;
+    for (auto id: ids)
+        map[id] = idx++;
+    bench::report("idHashMap", caseName, "insert", timer.elapsedMs() * 1000000.0 / ids.size(), "ns/op", ids.size());
+
+    timer.reset();
+    Idx sum = 0;
+    for (auto id: probes)
+    {
+        auto it = map.find(id);
+        if (it != map.end())
+            sum += it->second;
+    }
+    gSink = sum;
+    bench::report("idHashMap", caseName, "lookup", timer.elapsedMs() * 1000000.0 / probes.size(), "ns/op", probes.size());
+    bench::report("idHashMap", caseName, "memory", (double)memUsage(map) / ids.size(), "bytes/msg", ids.size());
+}
+
+static size_t stdMapMem(const StdMap&) { return gMapAllocBytes; }
+static size_t hashMapMem(const HashMap& map) { return map.memoryUsage(); }
+
+int main(int argc, char** argv)
+{
+    size_t lookupCount = bench::argInt(argc, argv, "--lookups", 1000000);
+    std::mt19937_64 rng(42);
+    for (size_t count: {10000, 100000, 1000000})
+    {
+        std::vector<uint64_t> ids(count);
+        for (auto& id: ids)
+        {
+            do { id = rng(); } while (!id);
+        }
+        //lookups are mostly hits, as for SEEN/RECEIVED/MSGUPD, with some misses
+        std::vector<uint64_t> probes(lookupCount);
+        for (size_t i = 0; i < lookupCount; i++)
+            probes[i] = (i % 8) ? ids[rng() % count] : (rng() | 1);
+        {
+            StdMap map;
+            runBench("std::map", map, ids, probes, stdMapMem);
+        }
+        {
+            HashMap map;
+            runBench("IdHashMap", map, ids, probes, hashMapMem);
+        }
+    }
+    return 0;
+}
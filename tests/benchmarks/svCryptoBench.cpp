@@ -0,0 +1,394 @@
+// Measures the throughput of the strongvelope message crypto: msgEncrypt() and
+// msgDecrypt() of followup messages, send key creation for different group sizes,
+// signature verification, nonce derivation and TLV encoding/parsing. Also checks
+// that an edit of a message that is being pre-decrypted gets its own content.
+// Runs offline - the pubkeys of all participants are served from a plain map,
+// so no client or MegaApi is needed.
+// Usage: svCryptoBench [--msgs N] [--keys N]
+
+#include <strongvelope/strongvelope.h>
+#include <strongvelope/tlvstore.h>
+#include <userAttrCache.h>
+#include <karereCommon.h>
+#include <db.h>
+#include <sodium.h>
+#include <vector>
+#include <map>
+#include <memory>
+#include "benchUtils.h"
+
+using namespace strongvelope;
+using namespace karere;
+using namespace chatd;
+
+// Serves preset attributes and never fetches
+class BenchAttrCache: public UserAttrProvider
+{
+protected:
+    std::map<UserAttrPair, std::unique_ptr<Buffer>> mAttrs;
+public:
+    void setAttr(Id user, unsigned attrType, const StaticBuffer& data)
+    {
+        mAttrs[UserAttrPair(user, attrType)].reset(new Buffer(data.buf(), data.dataSize()));
+    }
+    virtual Buffer* getCachedAttr(uint64_t user, unsigned attrType) const
+    {
+        auto it = mAttrs.find(UserAttrPair(user, attrType));
+        return (it == mAttrs.end()) ? nullptr : it->second.get();
+    }
+    virtual promise::Promise<Buffer*> getAttr(uint64_t user, unsigned attrType)
+    {
+        auto buf = getCachedAttr(user, attrType);
+        if (!buf)
+            return promise::Error("User attribute not preset");
+        return buf;
+    }
+    virtual void prefetchAttr(uint64_t user, unsigned attrType) {}
+};
+
+struct BenchUser
+{
+    Id handle;
+    Key<32> privCu25519;
+    Key<32> privEd25519;
+    BenchUser(Id aHandle, BenchAttrCache& attrCache): handle(aHandle)
+    {
+        randombytes_buf(privCu25519.ubuf(), 32);
+        randombytes_buf(privEd25519.ubuf(), 32);
+        Key<32> pubKey;
+        crypto_scalarmult_base(pubKey.ubuf(), privCu25519.ubuf());
+        attrCache.setAttr(handle, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY, pubKey);
+        unsigned char sk[crypto_sign_SECRETKEYBYTES];
+        crypto_sign_seed_keypair(pubKey.ubuf(), sk, privEd25519.ubuf());
+        attrCache.setAttr(handle, ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY, pubKey);
+    }
+};
+
+static sqlite3* openBenchDb(Id chatid)
+{
+    sqlite3* db;
+    if (sqlite3_open(":memory:", &db) != SQLITE_OK)
+        throw std::runtime_error("Can't open in-memory benchmark db");
+    sqliteSimpleQuery(db, gDbSchema);
+    sqliteQuery(db, "insert into chats(chatid, shard, own_priv) values(?,0,3)", chatid);
+    return db;
+}
+
+// Returns the key blob for \c user from a NEWKEY command, see KeyCommand::addKey()
+static StaticBuffer keyFor(const KeyCommand& cmd, Id user)
+{
+    //opcode.1 chatid.8 keyid.4 payloadlen.4, then userid.8 keylen.2 key.keylen...
+    for (size_t pos = 17; pos < cmd.dataSize();)
+    {
+        Id userid(cmd.read<uint64_t>(pos));
+        auto keylen = cmd.read<uint16_t>(pos+8);
+        if (userid == user)
+            return StaticBuffer(cmd.readPtr(pos+10, keylen), keylen);
+        pos += 10+keylen;
+    }
+    throw std::runtime_error("No key for user "+user.toString()+" in KeyCommand");
+}
+
+static MsgCommand* encryptOne(ProtocolHandler& crypto, Id chatid, Id sender,
+    Id msgid, const std::string& text, KeyCommand** keyCmd=nullptr)
+{
+    Message msg(msgid, sender, 0, 0, text.c_str(), text.size(), true);
+    auto msgCmd = new MsgCommand(OP_NEWMSG, chatid, sender, msgid, 0, 0, msg.keyid);
+    auto pms = crypto.msgEncrypt(&msg, msgCmd);
+    if (!pms.succeeded())
+        throw std::runtime_error("msgEncrypt did not complete synchronously");
+    if (keyCmd)
+        *keyCmd = pms.value().second;
+    return msgCmd;
+}
+
+static Message* toReceived(const MsgCommand& cmd, Id sender, uint16_t updated=0)
+{
+    auto data = cmd.msg();
+    auto msg = new Message(cmd.msgid(), sender, 0, updated,
+        data.buf(), data.dataSize(), false, cmd.keyId());
+    msg->setEncrypted(1);
+    return msg;
+}
+
+static bool hasText(const Message& msg, const std::string& text)
+{
+    return (msg.dataSize() == text.size()) && !memcmp(msg.buf(), text.c_str(), text.size());
+}
+
+// An edit (MSGUPD) of a history message that is being pre-decrypted by the
+// worker pool has the same msgid, but must not get the result for the
+// original content
+static void checkEditWhilePreDecrypting(ProtocolHandler& sender, ProtocolHandler& receiver,
+    Id chatid, Id senderId)
+{
+    Id msgid(0x7fff0001);
+    std::string original("original text");
+    std::string edited("edited text!!");
+    std::unique_ptr<MsgCommand> origCmd(encryptOne(sender, chatid, senderId, msgid, original));
+    std::unique_ptr<MsgCommand> editCmd(encryptOne(sender, chatid, senderId, msgid, edited));
+    std::unique_ptr<Message> histMsg(toReceived(*origCmd, senderId));
+    std::unique_ptr<Message> updMsg(toReceived(*editCmd, senderId, 1));
+
+    receiver.preDecrypt(std::vector<Message*>{histMsg.get()});
+    auto updPms = receiver.msgDecrypt(updMsg.get());
+    while (!updPms.done())
+        bench::processMessages();
+    if (!updPms.succeeded() || !hasText(*updMsg, edited))
+        throw std::runtime_error("An edit got the pre-decrypted content of the original message");
+
+    auto histPms = receiver.msgDecrypt(histMsg.get());
+    while (!histPms.done())
+        bench::processMessages();
+    if (!histPms.succeeded() || !hasText(*histMsg, original))
+        throw std::runtime_error("Pre-decryption of the original message failed");
+}
+
+static void benchMessages(size_t msgCount)
+{
+    Id chatid(0x5678);
+    BenchAttrCache attrCache;
+    BenchUser alice(0x1111, attrCache);
+    BenchUser bob(0x2222, attrCache);
+    SetOfIds users;
+    users.insert(alice.handle);
+    users.insert(bob.handle);
+    Buffer noRsa;
+    auto aliceDb = openBenchDb(chatid);
+    auto bobDb = openBenchDb(chatid);
+    {
+        ProtocolHandler aliceCrypto(alice.handle, alice.privCu25519, alice.privEd25519,
+            noRsa, attrCache, aliceDb, chatid);
+        ProtocolHandler bobCrypto(bob.handle, bob.privCu25519, bob.privEd25519,
+            noRsa, attrCache, bobDb, chatid);
+        aliceCrypto.setUsers(&users);
+        bobCrypto.setUsers(&users);
+
+        // Create and confirm alice's send key, and give it to bob
+        KeyCommand* keyCmd = nullptr;
+        delete encryptOne(aliceCrypto, chatid, alice.handle, 1, "x", &keyCmd);
+        if (!keyCmd)
+            throw std::runtime_error("No NEWKEY for the first message");
+        auto bobKey = keyFor(*keyCmd, bob.handle);
+        const KeyId keyid = 1;
+        bobCrypto.onKeyReceived(keyid, alice.handle, bob.handle, bobKey.buf(), bobKey.dataSize());
+        aliceCrypto.onKeyConfirmed(CHATD_KEYID_UNCONFIRMED, keyid);
+        bench::processMessages();
+        checkEditWhilePreDecrypting(aliceCrypto, bobCrypto, chatid, alice.handle);
+
+        for (size_t size: {16, 256, 4096, 65536})
+        {
+            std::string caseName = std::to_string(size)+"B";
+            std::string text(size, 'a');
+            std::vector<std::unique_ptr<MsgCommand>> cmds;
+            cmds.reserve(msgCount);
+            bench::Timer timer;
+            for (size_t i = 0; i < msgCount; i++)
+                cmds.emplace_back(encryptOne(aliceCrypto, chatid, alice.handle, i+2, text));
+            bench::report("svCrypto", caseName, "msgEncrypt", msgCount * 1000.0 / timer.elapsedMs(), "msg/s", msgCount);
+
+            std::vector<std::unique_ptr<Message>> msgs;
+            msgs.reserve(msgCount);
+            for (auto& cmd: cmds)
+                msgs.emplace_back(toReceived(*cmd, alice.handle));
+            //signature verification alone, on the parsed messages
+            std::vector<std::unique_ptr<ParsedMessage>> parsed;
+            parsed.reserve(msgCount);
+            for (auto& msg: msgs)
+                parsed.emplace_back(new ParsedMessage(*msg, bobCrypto));
+            auto edKey = attrCache.getCachedAttr(alice.handle, ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY);
+            SendKey aliceKey;
+            {
+                //alice's own key, as recorded in her db by onKeyConfirmed()
+                SqliteStmt stmt(aliceDb, "select key from sendkeys where userid=? and keyid=?");
+                stmt << alice.handle << keyid;
+                if (!stmt.step())
+                    throw std::runtime_error("Alice's send key is not in the db");
+                stmt.blobCol(0, aliceKey);
+            }
+            size_t failed = 0;
+            timer.reset();
+            for (auto& msg: parsed)
+            {
+                if (!msg->verifySignature(*edKey, aliceKey))
+                    failed++;
+            }
+            bench::report("svCrypto", caseName, "verifySignature", msgCount * 1000.0 / timer.elapsedMs(), "msg/s", msgCount);
+            parsed.clear();
+
+            timer.reset();
+            for (auto& msg: msgs)
+            {
+                auto pms = bobCrypto.msgDecrypt(msg.get());
+                if (!pms.succeeded())
+                    failed++;
+            }
+            bench::report("svCrypto", caseName, "msgDecrypt", msgCount * 1000.0 / timer.elapsedMs(), "msg/s", msgCount);
+            if (failed || !hasText(*msgs.back(), text))
+                throw std::runtime_error("Decryption or signature verification failed");
+            bench::processMessages();
+        }
+    }
+    bench::processMessages(); //calls posted for the deleted handlers are no-ops
+    sqliteCloseDb(aliceDb);
+    sqliteCloseDb(bobDb);
+}
+
+// Send key creation and its encryption to each participant, which is done
+// for the first message after a participant change
+static void benchKeyCreation(size_t keyCount)
+{
+    Id chatid(0x5678);
+    for (size_t groupSize: {2, 10, 50, 200})
+    {
+        BenchAttrCache attrCache;
+        std::vector<std::unique_ptr<BenchUser>> members;
+        SetOfIds users;
+        for (size_t i = 0; i < groupSize; i++)
+        {
+            members.emplace_back(new BenchUser(0x1000+i, attrCache));
+            users.insert(members.back()->handle);
+        }
+        auto& me = *members[0];
+        Buffer noRsa;
+        auto db = openBenchDb(chatid);
+        {
+            ProtocolHandler crypto(me.handle, me.privCu25519, me.privEd25519,
+                noRsa, attrCache, db, chatid);
+            crypto.setUsers(&users);
+            bench::Timer timer;
+            for (size_t i = 0; i < keyCount; i++)
+            {
+                crypto.resetSendKey();
+                KeyCommand* keyCmd = nullptr;
+                delete encryptOne(crypto, chatid, me.handle, i+1, "x", &keyCmd);
+                if (!keyCmd)
+                    throw std::runtime_error("No NEWKEY after a send key reset");
+            }
+            bench::report("svCrypto", "group-"+std::to_string(groupSize), "newSendKey",
+                keyCount * 1000.0 / timer.elapsedMs(), "key/s", keyCount);
+        }
+        bench::processMessages();
+        sqliteCloseDb(db);
+    }
+}
+
+static volatile char gSink;
+
+// TlvView must return the records written by TlvWriter, including a last record
+// too large for a 16-bit length, which is written with the 'until end of
+// container' length code (0xffff)
+static void checkTlvRoundTrip()
+{
+    Buffer big(70000);
+    big.appendFill(0x5a, 70000);
+    Key<12> nonce(12);
+    randombytes_buf(nonce.ubuf(), 12);
+    TlvWriter container(TlvWriter::recordSize(nonce.dataSize()) + TlvWriter::recordSize(big.dataSize()));
+    container.addRecord(TLV_TYPE_NONCE, nonce);
+    container.addRecord(TLV_TYPE_PAYLOAD, big);
+
+    auto equal = [](const StaticBuffer& a, const StaticBuffer& b)
+    {
+        return (a.dataSize() == b.dataSize()) && !memcmp(a.buf(), b.buf(), a.dataSize());
+    };
+    std::vector<TlvSlice> records;
+    for (auto& record: TlvView(container, 0, false))
+        records.push_back(record);
+    if ((records.size() != 2)
+     || (records[0].type != TLV_TYPE_NONCE) || !equal(records[0].value, nonce)
+     || (records[1].type != TLV_TYPE_PAYLOAD) || !equal(records[1].value, big))
+        throw std::runtime_error("TlvView doesn't return the records written by TlvWriter");
+}
+
+static void benchPrimitives(size_t count)
+{
+    Key<32> masterNonce;
+    randombytes_buf(masterNonce.ubuf(), 32);
+    Key<32> result;
+    bench::Timer timer;
+    for (size_t i = 0; i < count; i++)
+    {
+        masterNonce.buf()[0] = (char)i;
+        deriveNonceSecret(masterNonce, result);
+    }
+    gSink = result.buf()[0];
+    bench::report("svCrypto", "payload", "deriveNonceSecret", count * 1000.0 / timer.elapsedMs(), "op/s", count);
+
+    for (size_t size: {16, 256, 4096, 65536})
+    {
+        std::string caseName = std::to_string(size)+"B";
+        Buffer payload(size);
+        randombytes_buf(payload.buf(), size);
+        payload.setDataSize(size);
+        Key<64> signature(64);
+        randombytes_buf(signature.ubuf(), 64);
+        Key<12> nonce(12);
+        randombytes_buf(nonce.ubuf(), 12);
+
+        // The same record layout as msgEncryptWithKey()
+        timer.reset();
+        size_t total = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            TlvWriter tlv(TlvWriter::recordSize(signature.dataSize())
+                + TlvWriter::recordSize(nonce.dataSize()) + TlvWriter::recordSize(size));
+            tlv.addRecord(TLV_TYPE_SIGNATURE, signature);
+            tlv.addRecord(TLV_TYPE_NONCE, nonce);
+            tlv.addRecord(TLV_TYPE_PAYLOAD, payload);
+            total += tlv.dataSize();
+        }
+        gSink = (char)total;
+        bench::report("svCrypto", caseName, "TlvWriter", count * 1000.0 / timer.elapsedMs(), "msg/s", count);
+
+        TlvWriter container(size+128);
+        container.addRecord(TLV_TYPE_SIGNATURE, signature);
+        container.addRecord(TLV_TYPE_NONCE, nonce);
+        container.addRecord(TLV_TYPE_PAYLOAD, payload);
+        timer.reset();
+        total = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            TlvParser parser(container, 0, false);
+            TlvRecord record(container);
+            while (parser.getRecord(record))
+                total += record.dataLen;
+            total += record.dataLen; //the last one, if it has an 'until end' length
+        }
+        gSink = (char)total;
+        bench::report("svCrypto", caseName, "TlvParser", count * 1000.0 / timer.elapsedMs(), "msg/s", count);
+
+        timer.reset();
+        total = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            for (auto& record: TlvView(container, 0, false))
+                total += record.value.dataSize();
+        }
+        gSink = (char)total;
+        bench::report("svCrypto", caseName, "TlvView", count * 1000.0 / timer.elapsedMs(), "msg/s", count);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    size_t msgCount = bench::argInt(argc, argv, "--msgs", 10000);
+    size_t keyCount = bench::argInt(argc, argv, "--keys", 100);
+    if (sodium_init() == -1)
+        return 1;
+    karere::globalInit(bench::postMessage, 0, nullptr, 0);
+    try
+    {
+        checkTlvRoundTrip();
+        benchMessages(msgCount);
+        benchKeyCreation(keyCount);
+        benchPrimitives(msgCount * 10);
+    }
+    catch(std::exception& e)
+    {
+        fprintf(stderr, "svCryptoBench: %s\n", e.what());
+        return 1;
+    }
+    karere::globalCleanup();
+    return 0;
+}